@@ -1,54 +1,836 @@
+#include "envi_image.hpp"
+#include "hyperparameter_sweep.hpp"
 #include "layer.hpp"
 #include "neural_network.hpp"
+#include "pca_transform.hpp"
+#include "probability_raster.hpp"
 #include "spectral_image.hpp"
+#include "spectral_preprocessor.hpp"
 #include "spectral_train_set.hpp"
-#include "util/print.hpp"
+#include "util/options.hpp"
+#include "util/thread_affinity.hpp"
 
 #include <esl/dense.hpp>
 #include <esl/io.hpp>
 #include <esu/timer.hpp>
 
+#include <algorithm>
+#include <cstddef>
+#include <exception>
+#include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 
-int main()
+using Network = Neural_network<Conv_layer, Pooling_layer, Fc_layer, Output_layer>;
+
+const char usage[] = R"(Usage: cnn_hsi <command> [--config=<file>] [--<option>=<value> ...]
+
+Commands:
+  train       trains the network and saves the model
+  classify    classifies the image with the trained model
+  evaluate    reports the accuracy of the trained model on the labelled set
+  benchmark   measures training and classification throughput
+  sweep       trains networks with different hyperparameters concurrently
+  check       checks analytical gradients against finite differences
+  prune       prunes the trained model and optionally fine-tunes it
+
+Options:
+  --train=<file> --train-labels=<file>  training set
+  --data=<file> --labels=<file>         labelled set for evaluation or validation
+  --ground-truth=<file>                 label image to evaluate the image against
+  --ignored-label=<value>               true label of samples that are not evaluated, required
+                                        with the ground truth (e.g., 0 for unlabelled pixels)
+  --image=<file> [--header=<file>]      text image or ENVI raw cube with its header
+  --model-in=<file>                     model to classify with or to continue training,
+                                        comma-separated models are combined into an ensemble
+  --ensemble-rule=mean|vote             averaging of probabilities or majority voting of models
+  --model-out=<file>                    trained model, model.txt by default
+  --output=<file>                       MAT-file with labels or loss function, output.mat by default
+  --probabilities=<file>                raster of class probabilities and confidences
+  --probability-type=float32|float16|uint8
+                                        type of probabilities in the raster, uint8 stores
+                                        probabilities quantized to 1/255
+  --kernels=10 --kernel-size=20 --pooling-size=5 --fc-nodes=100
+                                        network topology, comma-separated lists for sweep
+  --iters=1500 --rate=0.2               training iterations and rate, lists of rates for sweep
+  --seed=0                              seed of random initial weights
+  --log-every=10                        loss function output period
+  --layout=feature_major|pixel_major    hidden layers activations layout
+  --threads=0                           number of threads, 0 means all hardware threads
+  --threads-per-network=1               number of threads per network in sweep
+  --batch-size=1024                     number of samples classified at once by each thread
+  --train-chunk-size=0                  number of samples passed through the network at once
+                                        by each training thread, 0 means all samples of the thread
+  --tile-size=16384                     number of pixels in image tiles that are read,
+                                        classified and written concurrently
+  --pin-threads                         pins training threads to CPUs
+  --async                               asynchronous training without synchronization
+  --remove-bands=water|<list>           zero-based bands removed from spectra before training,
+                                        water means water absorption bands of AVIRIS scenes
+  --select-bands=<list>                 zero-based bands retained in spectra
+  --bin-size=1                          number of adjacent retained bands averaged into one
+  --normalize                           normalizes bands with statistics of the training set;
+                                        the pre-processing is saved with the model and applied
+                                        to all spectra the model is used with
+  --pca=<value> [--whiten]              projects spectra onto the given number of principal
+                                        components of the training set, optionally whitened
+  --rank=<value> --endpoints=<list>     rank of the process and comma-separated endpoints
+                                        (unix:<path> or tcp:<host>:<port>) of all processes
+                                        in distributed training
+  --params-per-layer=50                 number of weights and of biases per layer to check
+  --fraction=0.9                        fraction of weights of fully connected layers to prune
+  --target-loss=<value>                 benchmarks time to reach the loss value
+                                        with synchronous and asynchronous training
+
+Options can also be given in the config file as "key = value" lines.
+)";
+
+struct Topology
 {
-	std::cout << std::setprecision(10);
+	std::size_t n_kernels;
+	std::size_t kernel_size;
+	std::size_t pooling_size;
+	std::size_t n_fc_nodes;
+	std::size_t n_classes;
+};
+
+struct Model
+{
+	Topology topology;
+	Network network;
+	// Applied to spectra while they are read
+	std::optional<Spectral_preprocessor> preprocessor;
+};
+
+Network make_network(const Topology& topology)
+{
+	return Network(Conv_layer(topology.n_kernels, topology.kernel_size), Pooling_layer(topology.pooling_size),
+		Fc_layer(topology.n_fc_nodes), Output_layer(topology.n_classes));
+}
+
+Topology read_topology(const Options& options, std::size_t n_classes)
+{
+	return {options.get<std::size_t>("kernels", 10), options.get<std::size_t>("kernel_size", 20),
+		options.get<std::size_t>("pooling_size", 5), options.get<std::size_t>("fc_nodes", 100), n_classes};
+}
+
+Activation_layout read_layout(const Options& options)
+{
+	const auto layout = options.get("layout", "feature_major");
+	if (layout == "feature_major")
+		return Activation_layout::feature_major;
+	if (layout == "pixel_major")
+		return Activation_layout::pixel_major;
+	throw std::runtime_error("Bad layout " + layout);
+}
+
+Raster_type read_raster_type(const Options& options)
+{
+	const auto type = options.get("probability_type", "float32");
+	if (type == "float32")
+		return Raster_type::float32;
+	if (type == "float16")
+		return Raster_type::float16;
+	if (type == "uint8")
+		return Raster_type::uint8;
+	throw std::runtime_error("Bad probability type " + type);
+}
+
+void configure(Network& network, const Options& options)
+{
+	network.set_n_threads(options.get("threads", 0u));
+	network.set_batch_size(options.get<std::size_t>("batch_size", 1024));
+	network.set_train_chunk_size(options.get<std::size_t>("train_chunk_size", 0));
+	network.set_pin_threads(options.get("pin_threads", false));
+
+	if (options.get("pin_threads", false) && !can_pin_threads())
+		std::cerr << "Warning: threads cannot be pinned to CPUs, --pin-threads is ignored" << std::endl;
+}
+
+template<typename T>
+std::vector<T> read_list(const Options& options, const std::string& key, T default_value)
+{
+	if (!options.has(key))
+		return {default_value};
+
+	std::vector<T> values;
+	std::istringstream ss(options.get(key));
+	for (std::string value; std::getline(ss, value, ',');)
+	{
+		std::istringstream vs(value);
+		T v;
+		if (!(vs >> v))
+			throw std::runtime_error("Bad value of option --" + key + ": " + options.get(key));
+		values.push_back(v);
+	}
+	return values;
+}
+
+bool has_preprocessor_options(const Options& options)
+{
+	return options.has("remove_bands") || options.has("select_bands") || options.has("bin_size") ||
+		   options.get("normalize", false);
+}
+
+// Creates the pre-processing stage given by the options, if any, and applies it
+// to the training set, normalization statistics are computed on the training set
+std::optional<Spectral_preprocessor> new_preprocessor(const Options& options, Spectral_train_set& train_set)
+{
+	if (!has_preprocessor_options(options))
+		return std::nullopt;
+
+	const auto read_bands = [&options, &train_set](const std::string& key)
+	{
+		auto bands = (options.get(key) == "water") ? Spectral_preprocessor::aviris_water_absorption_bands()
+												   : read_list<std::size_t>(options, key, 0);
+		for (auto band : bands)
+			if (band >= train_set.spectrum_size)
+				throw std::runtime_error("Bad band " + std::to_string(band) + " in option --" + key);
+		return bands;
+	};
+
+	Spectral_preprocessor preprocessor(train_set.spectrum_size);
+	if (options.has("select_bands"))
+		preprocessor.select_bands(read_bands("select_bands"));
+	if (options.has("remove_bands"))
+		preprocessor.remove_bands(read_bands("remove_bands"));
+
+	const auto bin_size = options.get<std::size_t>("bin_size", 1);
+	if (bin_size == 0)
+		throw std::runtime_error("Bad bin size");
+	preprocessor.set_bin_size(bin_size);
+	if (preprocessor.output_size() == 0)
+		throw std::runtime_error("No bands are retained");
+
+	train_set.data = preprocessor.apply(train_set.data);
+	train_set.spectrum_size = preprocessor.output_size();
+	if (options.get("normalize", false))
+	{
+		preprocessor.fit_normalization(train_set.data);
+		preprocessor.normalize(train_set.data);
+	}
+
+	return preprocessor;
+}
+
+// The input transform, if any, is fitted on the training set
+Model new_model(const Options& options, const Spectral_train_set& train_set)
+{
+	const auto topology = read_topology(options, train_set.n_label_values);
+
+	Model model{topology, make_network(topology), {}};
+	if (options.has("pca"))
+	{
+		const auto n_components = options.get<std::size_t>("pca", 0);
+		if (n_components == 0 || n_components > train_set.spectrum_size || train_set.size < 2)
+			throw std::runtime_error("Bad number of principal components " + options.get("pca"));
+		model.network.set_input_transform(
+			Pca_transform::fit(train_set.data, n_components, options.get("whiten", false)));
+	}
+	model.network.init(Random_init{.05, options.get("seed", 0u)}, train_set.spectrum_size, read_layout(options));
+	return model;
+}
 
-	const auto image = read_image("salinas.txt");
-	const auto train_set = read_train_set("salinas_train.txt", "salinas_train_labels.txt");
+// The model file contains the topology followed by the pre-processing stage,
+// if any, and the network parameters
+Model load_model(const std::string& file_name)
+{
+	std::ifstream file(file_name);
+	if (!file)
+		throw std::runtime_error("Cannot open file " + file_name);
+
+	std::string tag;
+	Topology topology;
+	int has_preprocessor;
+	file >> tag >> topology.n_kernels >> topology.kernel_size >> topology.pooling_size >> topology.n_fc_nodes >>
+		topology.n_classes >> has_preprocessor;
+	if (!file || tag != "cnn_hsi_model")
+		throw std::runtime_error("Bad model file " + file_name);
+
+	Model model{topology, make_network(topology), {}};
+	if (has_preprocessor)
+		model.preprocessor = Spectral_preprocessor::load(file);
+	model.network.load(file);
+	return model;
+}
+
+void save_model(const Model& model, const std::string& file_name)
+{
+	std::ofstream file(file_name);
+	if (!file)
+		throw std::runtime_error("Cannot open file " + file_name);
+
+	const auto& t = model.topology;
+	file << "cnn_hsi_model " << t.n_kernels << ' ' << t.kernel_size << ' ' << t.pooling_size << ' ' << t.n_fc_nodes
+		 << ' ' << t.n_classes << ' ' << (model.preprocessor ? 1 : 0) << '\n';
+	if (model.preprocessor)
+		model.preprocessor->save(file);
+	model.network.save(file);
+
+	if (!file)
+		throw std::runtime_error("Cannot write file " + file_name);
+}
+
+template<class Classifier>
+void check_input_size(const Classifier& classifier, std::size_t spectrum_size)
+{
+	if (classifier.input_size() != spectrum_size)
+		throw std::runtime_error("Model input size " + std::to_string(classifier.input_size()) +
+								 " does not match spectrum size " + std::to_string(spectrum_size));
+}
 
-	auto network = make_neural_network(
-		Conv_layer(10, 20), Pooling_layer(5), Fc_layer(100), Output_layer(train_set.n_label_values));
+// Loads models of the ensemble, they should have the same input size, number of classes
+// and pre-processing stage, which is returned in the last argument
+Ensemble_classifier<Network> load_ensemble(const Options& options, const std::vector<std::string>& file_names,
+	std::optional<Spectral_preprocessor>& preprocessor)
+{
+	std::vector<Network> networks;
+	for (const auto& file_name : file_names)
+	{
+		auto model = load_model(file_name);
+		if (networks.empty())
+			preprocessor = model.preprocessor;
+		else if (model.network.input_size() != networks.front().input_size() ||
+				 model.network.output_size() != networks.front().output_size() || !(model.preprocessor == preprocessor))
+			throw std::runtime_error("Model " + file_name + " is inconsistent with " + file_names.front());
+		networks.push_back(std::move(model.network));
+	}
+
+	const auto rule = options.get("ensemble_rule", "mean");
+	if (rule != "mean" && rule != "vote")
+		throw std::runtime_error("Bad ensemble rule " + rule);
+
+	Ensemble_classifier ensemble(std::move(networks), rule == "mean" ? Ensemble_rule::mean : Ensemble_rule::vote);
+	ensemble.set_n_threads(options.get("threads", 0u));
+	ensemble.set_batch_size(options.get<std::size_t>("batch_size", 1024));
+	return ensemble;
+}
+
+// Calls fn(reader) with the tile reader of the text image or of the ENVI raw cube
+// that applies the pre-processing stage, if any
+template<class Fn>
+void with_tile_reader(const Options& options, const std::optional<Spectral_preprocessor>& preprocessor, Fn fn)
+{
+	const auto n_pixels_per_tile = options.get<std::size_t>("tile_size", 16384);
+	if (options.has("header"))
+	{
+		const auto format = read_envi_header(options.get("header"));
+		if (preprocessor)
+		{
+			Raw_image_tile_reader reader(options.get("image"), format, n_pixels_per_tile, *preprocessor);
+			fn(reader);
+		}
+		else
+		{
+			Raw_image_tile_reader reader(options.get("image"), format, n_pixels_per_tile);
+			fn(reader);
+		}
+	}
+	else if (preprocessor)
+	{
+		Text_image_tile_reader reader(options.get("image"), n_pixels_per_tile, *preprocessor);
+		fn(reader);
+	}
+	else
+	{
+		Text_image_tile_reader reader(options.get("image"), n_pixels_per_tile);
+		fn(reader);
+	}
+}
+
+// Reads a labelled set applying the pre-processing stage of the model, if any
+Spectral_train_set read_train_set(const Model& model, const std::string& data_file_name,
+	const std::string& labels_file_name)
+{
+	if (model.preprocessor)
+		return read_train_set(data_file_name, labels_file_name, *model.preprocessor);
+	return read_train_set(data_file_name, labels_file_name);
+}
+
+// Loads the model and reads the training set with its pre-processing stage,
+// or reads the training set and creates a new model with the pre-processing
+// stage given by the options
+Model load_or_new_model(const Options& options, Spectral_train_set& train_set)
+{
+	if (options.has("model_in"))
+	{
+		if (has_preprocessor_options(options))
+			throw std::runtime_error("The pre-processing stage of the loaded model cannot be changed");
+
+		auto model = load_model(options.get("model_in"));
+		train_set = read_train_set(model, options.get("train"), options.get("train_labels"));
+		return model;
+	}
+
+	train_set = read_train_set(options.get("train"), options.get("train_labels"));
+	auto preprocessor = new_preprocessor(options, train_set);
+
+	auto model = new_model(options, train_set);
+	model.preprocessor = std::move(preprocessor);
+	return model;
+}
+
+void train(const Options& options)
+{
+	Spectral_train_set train_set;
+	auto model = load_or_new_model(options, train_set);
+	auto& network = model.network;
+	configure(network, options);
+	check_input_size(network, train_set.spectrum_size);
 
-	network.init(Random_init{.05}, train_set.spectrum_size);
 	std::cout << network.info_string() << std::endl;
 
-	// network.check_gradients(train_set.data, train_set.labels);
-	// return 0;
+	// In distributed training each process reads the whole training set and trains
+	// on its own shard, the loss function and the model are output by rank 0 only
+	std::optional<Communicator> comm;
+	if (options.has("endpoints"))
+	{
+		if (options.get("async", false))
+			throw std::runtime_error("Asynchronous training cannot be distributed");
+		const auto endpoints = read_list<std::string>(options, "endpoints", {});
+		const auto rank = options.get<std::size_t>("rank", endpoints.size());
+		if (rank >= endpoints.size())
+			throw std::runtime_error("Distributed training requires --rank less than the number of endpoints");
+		comm.emplace(rank, endpoints);
+	}
+	const bool is_root = !comm || comm->rank() == 0;
+
+	const auto log_every = is_root ? options.get("log_every", 10u) : 0u;
+	const auto log = [log_every](std::size_t it, double loss)
+	{
+		if (log_every > 0 && it % log_every == 0)
+			std::cout << it << ". " << loss << std::endl;
+	};
+
+	const auto n_iters = options.get("iters", 1500u);
+	const auto rate = options.get("rate", .2);
 
 	esu::Timer tm;
 	tm.start();
-	const auto loss = network.train(train_set.data, train_set.labels, 1500, .2, [](std::size_t it, double loss)
+	const auto loss = [&]()
 	{
-		if (it % 10 == 0)
-			std::cout << it << ". " << loss << std::endl;
-	});
+		if (comm)
+		{
+			const auto [first, n] = comm->shard(train_set.size);
+			return network.train(
+				train_set.data.cols_view(first, n), train_set.labels.rows_view(first, n), *comm, n_iters, rate, log);
+		}
+		return options.get("async", false)
+			? network.train_async(train_set.data, train_set.labels, n_iters, rate, log)
+			: network.train(train_set.data, train_set.labels, n_iters, rate, log);
+	}();
 	tm.stop();
 
 	std::cout << "Training took " << tm.sec() << " seconds" << std::endl;
+	if (!is_root)
+		return;
+
+	save_model(model, options.get("model_out", "model.txt"));
+
+	esl::Matfile_writer mw(options.get("output", "output.mat"));
+	mw.write("loss_fn", loss);
+}
+
+// The calling thread reads tiles, while the network or the ensemble classifies
+// previous ones and the writer thread stores their labels and probabilities
+template<class Classifier, class Tile_reader>
+void classify_tiles(const Options& options, const Classifier& classifier, Tile_reader& reader)
+{
+	check_input_size(classifier, reader.spectrum_size());
 
+	const auto rows = reader.rows();
+	const auto cols = reader.cols();
+
+	std::optional<Probability_raster_writer> writer;
+	if (options.has("probabilities"))
+		writer.emplace(options.get("probabilities"), rows, cols, classifier.output_size(), read_raster_type(options));
+
+	esl::Vector_x<std::size_t> labels(rows * cols);
+	const auto write = [&labels, &writer, rows](const Classified_tile& tile)
+	{
+		for (std::size_t col = 0; col < tile.cols; ++col)
+			for (std::size_t row = 0; row < tile.rows; ++row)
+				labels[tile.first_row + row + (tile.first_col + col) * rows] = tile.labels[row + col * tile.rows];
+
+		if (writer)
+			writer->write(tile.first_row, tile.first_col, tile.rows, tile.probabilities);
+	};
+
+	esu::Timer tm;
 	tm.start();
-	const auto image_labels = network.classify(image.data);
+	classifier.classify_tiles(reader, write, writer.has_value());
 	tm.stop();
 
-	std::cout << "Classification took " << tm.sec() << " seconds" << std::endl;
+	std::cout << "Reading and classification took " << tm.sec() << " seconds" << std::endl;
 
-	esl::Matfile_writer mw("output.mat");
-	mw.write("rows", image.rows);
-	mw.write("cols", image.cols);
-	mw.write("labels", image_labels);
-	mw.write("loss_fn", loss);
+	esl::Matfile_writer mw(options.get("output", "output.mat"));
+	mw.write("rows", rows);
+	mw.write("cols", cols);
+	mw.write("labels", labels);
+}
+
+// Several comma-separated models are combined into an ensemble
+void classify(const Options& options)
+{
+	const auto model_file_names = read_list<std::string>(options, "model_in", options.get("model_in"));
+	if (model_file_names.size() > 1)
+	{
+		std::optional<Spectral_preprocessor> preprocessor;
+		const auto ensemble = load_ensemble(options, model_file_names, preprocessor);
+		with_tile_reader(options, preprocessor,
+			[&options, &ensemble](auto& reader) { classify_tiles(options, ensemble, reader); });
+		return;
+	}
+
+	auto model = load_model(model_file_names.front());
+	configure(model.network, options);
+
+	with_tile_reader(options, model.preprocessor,
+		[&options, &model](auto& reader) { classify_tiles(options, model.network, reader); });
+}
+
+void print_evaluation(const Confusion_matrix& confusion_matrix)
+{
+	std::cout << "Overall accuracy: " << confusion_matrix.overall_accuracy() << " (" << confusion_matrix.n_correct()
+			  << '/' << confusion_matrix.n_samples() << ")\n"
+			  << "Kappa: " << confusion_matrix.kappa() << '\n'
+			  << "Class accuracies:\n";
+
+	for (std::size_t i = 0; i < confusion_matrix.n_classes(); ++i)
+		if (confusion_matrix.n_samples(i) > 0)
+			std::cout << std::setw(4) << i << ". " << confusion_matrix.class_accuracy(i) << " ("
+					  << confusion_matrix(i, i) << '/' << confusion_matrix.n_samples(i) << ")\n";
+	std::cout << std::flush;
+}
+
+// Evaluates the model on the labelled set, or on the image with its ground truth;
+// the image is read tile by tile, only labelled pixels are classified
+// and their labels are not stored
+void evaluate(const Options& options)
+{
+	auto model = load_model(options.get("model_in"));
+	auto& network = model.network;
+	configure(network, options);
+
+	if (!options.has("image"))
+	{
+		const auto test_set = read_train_set(model, options.get("data"), options.get("labels"));
+		check_input_size(network, test_set.spectrum_size);
+
+		const auto ignored_label = options.get("ignored_label", Confusion_matrix::no_label);
+		print_evaluation(network.evaluate(test_set.data, test_set.labels, ignored_label));
+		return;
+	}
+
+	const auto evaluate_tiles = [&options, &network](auto& reader)
+	{
+		check_input_size(network, reader.spectrum_size());
+
+		const auto rows = reader.rows();
+		const auto true_labels = read_label_image(options.get("ground_truth"), rows, reader.cols());
+		if (!options.has("ignored_label"))
+			throw std::runtime_error("Evaluation against the ground truth requires --ignored-label");
+		const auto ignored_label = options.get<std::size_t>("ignored_label", 0);
+		for (std::size_t j = 0; j < true_labels.size(); ++j)
+			if (true_labels[j] >= network.output_size() && true_labels[j] != ignored_label)
+				throw std::runtime_error("Bad ground truth label " + std::to_string(true_labels[j]));
+
+		Confusion_matrix confusion_matrix(network.output_size());
+		Image_tile tile;
+		std::vector<std::size_t> tile_true_labels;
+		std::vector<bool> mask;
+		while (reader.next(tile))
+		{
+			tile_true_labels.resize(tile.rows * tile.cols);
+			mask.resize(tile_true_labels.size());
+			for (std::size_t col = 0; col < tile.cols; ++col)
+				for (std::size_t row = 0; row < tile.rows; ++row)
+				{
+					const auto j = row + col * tile.rows;
+					tile_true_labels[j] = true_labels[tile.first_row + row + (tile.first_col + col) * rows];
+					mask[j] = (tile_true_labels[j] != ignored_label);
+				}
+
+			if (std::none_of(mask.begin(), mask.end(), [](bool valid) { return valid; }))
+				continue;
+
+			const auto labels = network.classify(tile.data, mask, Confusion_matrix::no_label);
+			for (std::size_t j = 0; j < mask.size(); ++j)
+				if (mask[j])
+					confusion_matrix.add(tile_true_labels[j], labels[j]);
+		}
+
+		print_evaluation(confusion_matrix);
+	};
+
+	with_tile_reader(options, model.preprocessor, evaluate_tiles);
+}
+
+// Compares the time the synchronous and the asynchronous training
+// take to reach the target value of the loss function
+void benchmark_time_to_loss(const Options& options, const Spectral_train_set& train_set, const Topology& topology)
+{
+	const auto target_loss = options.get("target_loss", 0.);
+	const auto n_iters = options.get("iters", 10u);
+
+	for (const bool async : {false, true})
+	{
+		auto network = make_network(topology);
+		configure(network, options);
+		network.init(Random_init{.05}, train_set.spectrum_size, read_layout(options));
+
+		esu::Timer tm;
+		std::optional<std::pair<std::size_t, double>> reached;
+		const auto check = [&](std::size_t it, double loss)
+		{
+			if (!reached && loss <= target_loss)
+			{
+				tm.stop();
+				reached.emplace(it, tm.sec());
+			}
+		};
+
+		tm.start();
+		if (async)
+			network.train_async(train_set.data, train_set.labels, n_iters, options.get("rate", .2), check);
+		else
+			network.train(train_set.data, train_set.labels, n_iters, options.get("rate", .2), check);
+
+		std::cout << (async ? "Asynchronous" : "Synchronous") << " training: ";
+		if (reached)
+			std::cout << "loss " << target_loss << " reached at iteration " << reached->first << " after "
+					  << reached->second << " seconds" << std::endl;
+		else
+			std::cout << "loss " << target_loss << " not reached in " << n_iters << " iterations" << std::endl;
+	}
+}
+
+// Measures training and classification time for numbers of threads
+// that are powers of two, with and without thread pinning
+void benchmark(const Options& options)
+{
+	const auto train_set = read_train_set(options.get("train"), options.get("train_labels"));
+	const auto topology = read_topology(options, train_set.n_label_values);
+	const auto n_iters = options.get("iters", 10u);
+
+	std::vector<unsigned int> n_threads;
+	if (options.has("threads"))
+		n_threads.push_back(options.get("threads", 0u));
+	else
+	{
+		const auto max_n_threads = std::max(1u, std::thread::hardware_concurrency());
+		for (unsigned int n = 1; n < max_n_threads; n *= 2)
+			n_threads.push_back(n);
+		n_threads.push_back(max_n_threads);
+	}
+
+	// Pinned threads are only measured if they can be pinned
+	std::vector<bool> pin_modes = {false};
+	if (can_pin_threads())
+		pin_modes.push_back(true);
+	else
+		std::cout << "Threads cannot be pinned to CPUs, only unpinned threads are measured" << std::endl;
+
+	std::cout << "threads  pinned  training, ms/iter  classification, samples/s" << std::endl;
+	for (const auto n : n_threads)
+		for (const bool pin : pin_modes)
+		{
+			auto network = make_network(topology);
+			network.set_n_threads(n);
+			network.set_batch_size(options.get<std::size_t>("batch_size", 1024));
+			network.set_train_chunk_size(options.get<std::size_t>("train_chunk_size", 0));
+			network.set_pin_threads(pin);
+			network.init(Random_init{.05}, train_set.spectrum_size, read_layout(options));
+
+			esu::Timer tm;
+			tm.start();
+			network.train(train_set.data, train_set.labels, n_iters, options.get("rate", .2));
+			tm.stop();
+			const auto train_time = tm.sec();
+
+			tm.start();
+			network.classify(train_set.data);
+			tm.stop();
+			const auto classify_time = tm.sec();
+
+			std::cout << std::fixed << std::setprecision(2) << std::setw(7) << network.n_threads() << std::setw(8)
+					  << (pin ? "yes" : "no") << std::setw(19) << 1000 * train_time / n_iters << std::setw(27)
+					  << train_set.size / classify_time << std::endl;
+		}
+
+	if (options.has("target_loss"))
+		benchmark_time_to_loss(options, train_set, topology);
+}
+
+// Checks gradients of the new network, or of the loaded one, on the training set;
+// returns false if gradients of some layer are wrong
+bool check(const Options& options)
+{
+	Spectral_train_set train_set;
+	auto model = load_or_new_model(options, train_set);
+	auto& network = model.network;
+	configure(network, options);
+	check_input_size(network, train_set.spectrum_size);
+
+	const auto checks =
+		network.check_gradients(train_set.data, train_set.labels, options.get<std::size_t>("params_per_layer", 50));
+
+	for (const auto& check : checks)
+		std::cout << check.layer_index + 1 << ". " << check.layer_name << ": " << check.n_checked_params
+				  << " parameters checked, " << check.n_skipped_params
+				  << " skipped, max relative error = " << check.max_relative_error
+				  << (check.is_passed ? "" : " (FAILED)") << std::endl;
+
+	return std::all_of(checks.begin(), checks.end(), [](const auto& check) { return check.is_passed; });
+}
+
+// Prunes weights of fully connected layers and fine-tunes
+// the pruned model if the training set is given
+void prune(const Options& options)
+{
+	auto model = load_model(options.get("model_in"));
+	auto& network = model.network;
+	configure(network, options);
+
+	network.prune(options.get("fraction", .9));
+
+	if (options.has("train"))
+	{
+		const auto train_set = read_train_set(model, options.get("train"), options.get("train_labels"));
+		check_input_size(network, train_set.spectrum_size);
+
+		const auto log_every = options.get("log_every", 10u);
+		network.train(train_set.data, train_set.labels, options.get("iters", 100u), options.get("rate", .2),
+			[log_every](std::size_t it, double loss)
+			{
+				if (log_every > 0 && it % log_every == 0)
+					std::cout << it << ". " << loss << std::endl;
+			});
+	}
+
+	std::cout << network.info_string() << std::endl;
+	save_model(model, options.get("model_out", "model.txt"));
+}
+
+// Trains networks with different hyperparameters concurrently
+// and prints their validation accuracies
+void sweep(const Options& options)
+{
+	const auto train_set = read_train_set(options.get("train"), options.get("train_labels"));
+	const auto validation_set = read_train_set(options.get("data"), options.get("labels"));
+
+	const auto configs = make_sweep_grid(read_list<std::size_t>(options, "kernels", 10),
+		read_list<std::size_t>(options, "kernel_size", 20), read_list<std::size_t>(options, "pooling_size", 5),
+		read_list<std::size_t>(options, "fc_nodes", 100), read_list(options, "rate", .2),
+		options.get("iters", 500u));
+
+	print_sweep_results(
+		std::cout, run_sweep(train_set, validation_set, configs, options.get("threads_per_network", 1u)));
+}
+
+// Returns options accepted by the command in addition to --config,
+// or nothing if the command is unknown
+std::vector<std::string> command_options(const std::string& command)
+{
+	const std::vector<std::string> network_options = {"threads", "batch-size", "train-chunk-size", "pin-threads"};
+	const std::vector<std::string> topology_options = {"kernels", "kernel-size", "pooling-size", "fc-nodes", "layout"};
+	const std::vector<std::string> image_options = {"image", "header", "tile-size"};
+
+	std::vector<std::string> keys;
+	const auto add = [&keys](const std::vector<std::string>& more)
+	{
+		keys.insert(keys.end(), more.begin(), more.end());
+	};
+
+	if (command == "train")
+	{
+		add(network_options);
+		add(topology_options);
+		add({"train", "train-labels", "model-in", "seed", "log-every", "iters", "rate", "async", "model-out",
+			"output", "rank", "endpoints", "remove-bands", "select-bands", "bin-size", "normalize", "pca", "whiten"});
+	}
+	else if (command == "classify")
+	{
+		add(network_options);
+		add(image_options);
+		add({"model-in", "ensemble-rule", "probabilities", "probability-type", "output"});
+	}
+	else if (command == "evaluate")
+	{
+		add(network_options);
+		add(image_options);
+		add({"model-in", "data", "labels", "ground-truth", "ignored-label"});
+	}
+	else if (command == "benchmark")
+	{
+		add(network_options);
+		add(topology_options);
+		add({"train", "train-labels", "iters", "rate", "target-loss"});
+	}
+	else if (command == "sweep")
+	{
+		add({"train", "train-labels", "data", "labels", "kernels", "kernel-size", "pooling-size", "fc-nodes", "rate",
+			"iters", "threads-per-network"});
+	}
+	else if (command == "check")
+	{
+		add(network_options);
+		add(topology_options);
+		add({"train", "train-labels", "model-in", "seed", "params-per-layer"});
+	}
+	else if (command == "prune")
+	{
+		add(network_options);
+		add({"model-in", "fraction", "train", "train-labels", "log-every", "iters", "rate", "model-out"});
+	}
+
+	return keys;
+}
+
+int main(int argc, char* argv[])
+{
+	std::cout << std::setprecision(10);
+
+	try
+	{
+		const Options options(argc, argv);
+		const auto& command = options.command();
+
+		const auto keys = command_options(command);
+		if (keys.empty())
+		{
+			std::cout << usage;
+			return command.empty() ? 0 : 1;
+		}
+		options.check_keys(keys);
+
+		if (command == "train")
+			train(options);
+		else if (command == "classify")
+			classify(options);
+		else if (command == "evaluate")
+			evaluate(options);
+		else if (command == "benchmark")
+			benchmark(options);
+		else if (command == "sweep")
+			sweep(options);
+		else if (command == "check")
+			return check(options) ? 0 : 1;
+		else if (command == "prune")
+			prune(options);
+	}
+	catch (const std::exception& e)
+	{
+		std::cerr << "Error: " << e.what() << std::endl;
+		return 1;
+	}
 
 	return 0;
 }
@@ -0,0 +1,442 @@
+#pragma once
+#include "spectral_image.hpp"
+#include "spectral_preprocessor.hpp"
+
+#include <esl/dense.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+enum class Interleave
+{
+	// Band sequential
+	bsq,
+	// Band interleaved by line
+	bil,
+	// Band interleaved by pixel
+	bip
+};
+
+// Values correspond to ENVI data type codes
+enum class Sample_type
+{
+	uint8 = 1,
+	int16 = 2,
+	int32 = 3,
+	float32 = 4,
+	float64 = 5,
+	uint16 = 12
+};
+
+struct Raw_cube_format
+{
+	std::size_t rows;
+	std::size_t cols;
+	std::size_t bands;
+	Interleave interleave = Interleave::bsq;
+	Sample_type sample_type = Sample_type::float32;
+	bool big_endian = false;
+	std::size_t header_offset = 0;
+};
+
+// Parses "samples", "lines", "bands", "interleave", "data type",
+// "byte order" and "header offset" fields of an ENVI header file
+Raw_cube_format read_envi_header(const std::string& file_name)
+{
+	std::ifstream file;
+	file.exceptions(std::ifstream::badbit);
+	file.open(file_name);
+	if (!file)
+		throw std::runtime_error("Cannot open file " + file_name);
+
+	const auto trim = [](std::string str)
+	{
+		const auto first = str.find_first_not_of(" \t\r");
+		const auto last = str.find_last_not_of(" \t\r");
+		str = (first == std::string::npos) ? std::string{} : str.substr(first, last - first + 1);
+		std::transform(str.begin(), str.end(), str.begin(), [](unsigned char ch) { return std::tolower(ch); });
+		return str;
+	};
+
+	Raw_cube_format format{0, 0, 0};
+	std::string line;
+	while (std::getline(file, line))
+	{
+		const auto eq = line.find('=');
+		if (eq == std::string::npos)
+			continue;
+
+		const auto key = trim(line.substr(0, eq));
+		const auto value = trim(line.substr(eq + 1));
+
+		// Multi-line values in braces are not used
+		if (!value.empty() && value.front() == '{')
+		{
+			while (line.find('}') == std::string::npos && std::getline(file, line))
+				;
+			continue;
+		}
+
+		if (key == "samples")
+			format.cols = std::stoul(value);
+		else if (key == "lines")
+			format.rows = std::stoul(value);
+		else if (key == "bands")
+			format.bands = std::stoul(value);
+		else if (key == "header offset")
+			format.header_offset = std::stoul(value);
+		else if (key == "byte order")
+			format.big_endian = (std::stoul(value) == 1);
+		else if (key == "data type")
+			format.sample_type = static_cast<Sample_type>(std::stoul(value));
+		else if (key == "interleave")
+		{
+			if (value == "bsq")
+				format.interleave = Interleave::bsq;
+			else if (value == "bil")
+				format.interleave = Interleave::bil;
+			else if (value == "bip")
+				format.interleave = Interleave::bip;
+			else
+				throw std::runtime_error("Unknown interleave in " + file_name + ": " + value);
+		}
+	}
+
+	if (format.rows == 0 || format.cols == 0 || format.bands == 0)
+		throw std::runtime_error("Incomplete ENVI header " + file_name);
+
+	return format;
+}
+
+namespace internal
+{
+template<typename T>
+void decode_samples(const unsigned char* bytes, std::size_t n, bool swap_bytes, double* values)
+{
+	for (std::size_t i = 0; i < n; ++i)
+	{
+		unsigned char sample[sizeof(T)];
+		std::memcpy(sample, bytes + i * sizeof(T), sizeof(T));
+		if (swap_bytes)
+			std::reverse(sample, sample + sizeof(T));
+
+		T value;
+		std::memcpy(&value, sample, sizeof(T));
+		values[i] = static_cast<double>(value);
+	}
+}
+
+inline std::size_t sample_size(Sample_type type)
+{
+	switch (type)
+	{
+	case Sample_type::uint8:
+		return 1;
+	case Sample_type::int16:
+	case Sample_type::uint16:
+		return 2;
+	case Sample_type::int32:
+	case Sample_type::float32:
+		return 4;
+	case Sample_type::float64:
+		return 8;
+	}
+	throw std::runtime_error("Unsupported sample type");
+}
+
+inline void decode_samples(
+	const unsigned char* bytes, std::size_t n, Sample_type type, bool big_endian, double* values)
+{
+	const bool swap_bytes = (big_endian != (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__));
+	switch (type)
+	{
+	case Sample_type::uint8:
+		return decode_samples<std::uint8_t>(bytes, n, swap_bytes, values);
+	case Sample_type::int16:
+		return decode_samples<std::int16_t>(bytes, n, swap_bytes, values);
+	case Sample_type::uint16:
+		return decode_samples<std::uint16_t>(bytes, n, swap_bytes, values);
+	case Sample_type::int32:
+		return decode_samples<std::int32_t>(bytes, n, swap_bytes, values);
+	case Sample_type::float32:
+		return decode_samples<float>(bytes, n, swap_bytes, values);
+	case Sample_type::float64:
+		return decode_samples<double>(bytes, n, swap_bytes, values);
+	}
+}
+
+// Reads the cube, or a range of its lines, in slabs of whole lines or
+// whole band planes and scatters each slab into the (bands x pixels)
+// matrix with a tiled transposition, so that only one slab-size buffer
+// is needed; pixel (row, col) is stored in the column
+// (row - first_row) + col * n_rows
+class Raw_cube_reader
+{
+public:
+	Raw_cube_reader(const std::string& file_name, const Raw_cube_format& format) : format_(format)
+	{
+		file_.exceptions(std::ifstream::badbit | std::ifstream::failbit);
+		file_.open(file_name, std::ios::binary);
+	}
+
+	void read(esl::Matrix_xd& data)
+	{
+		read_lines(0, format_.rows, data);
+	}
+
+	void read_lines(std::size_t first_row, std::size_t n_rows, esl::Matrix_xd& data)
+	{
+		assert(first_row + n_rows <= format_.rows);
+
+		data.resize(format_.bands, n_rows * format_.cols);
+		read(first_row, n_rows,
+			[&data](std::size_t band, std::size_t index, double value) { data(band, index) = value; });
+	}
+
+	// Reads reduced spectra, full-width spectra are never stored
+	void read(esl::Matrix_xd& data, const Spectral_preprocessor& preprocessor)
+	{
+		read_lines(0, format_.rows, data, preprocessor);
+	}
+
+	void read_lines(std::size_t first_row, std::size_t n_rows, esl::Matrix_xd& data,
+		const Spectral_preprocessor& preprocessor)
+	{
+		assert(first_row + n_rows <= format_.rows);
+		if (format_.bands != preprocessor.input_size())
+			throw std::runtime_error("Inconsistent spectrum size of raw cube");
+
+		const auto n_pixels = n_rows * format_.cols;
+		data.resize(preprocessor.output_size(), n_pixels);
+		for (std::size_t j = 0; j < n_pixels; ++j)
+			preprocessor.init_spectrum(data.col_view(j).data());
+
+		read(first_row, n_rows, [&data, &preprocessor](std::size_t band, std::size_t index, double value)
+		{
+			preprocessor.add_value(band, value, data.col_view(index).data());
+		});
+	}
+
+private:
+	template<class Store_fn>
+	void read(std::size_t first_row, std::size_t n_rows, Store_fn store)
+	{
+		switch (format_.interleave)
+		{
+		case Interleave::bsq:
+			return read_bsq(first_row, n_rows, store);
+		case Interleave::bil:
+			return read_bil(first_row, n_rows, store);
+		case Interleave::bip:
+			return read_bip(first_row, n_rows, store);
+		}
+	}
+
+	// Reads n samples starting from the one with the given index
+	// in the file into the slab buffer at the given position
+	void read_samples(std::size_t index, std::size_t n, std::size_t position)
+	{
+		const auto size = sample_size(format_.sample_type);
+		bytes_.resize(n * size);
+
+		file_.seekg(static_cast<std::streamoff>(format_.header_offset + index * size));
+		file_.read(reinterpret_cast<char*>(bytes_.data()), static_cast<std::streamsize>(bytes_.size()));
+		decode_samples(bytes_.data(), n, format_.sample_type, format_.big_endian, values_.data() + position);
+	}
+
+	// A slab contains the lines of several band planes; a block of bands
+	// fills whole cache lines of the destination matrix;
+	// store(band, index, value) stores a sample
+	template<class Store_fn>
+	void read_bsq(std::size_t first_row, std::size_t n_rows, Store_fn store)
+	{
+		const auto cols = format_.cols;
+		const auto n_pixels = format_.rows * cols;
+		const auto n_slab_pixels = n_rows * cols;
+
+		for (std::size_t band = 0; band < format_.bands; band += bands_per_slab)
+		{
+			const auto n_bands = std::min(bands_per_slab, format_.bands - band);
+			values_.resize(n_bands * n_slab_pixels);
+			for (std::size_t b = 0; b < n_bands; ++b)
+				read_samples((band + b) * n_pixels + first_row * cols, n_slab_pixels, b * n_slab_pixels);
+
+			const auto slab = values_.data();
+			for (std::size_t col0 = 0; col0 < cols; col0 += tile_size)
+				for (std::size_t row0 = 0; row0 < n_rows; row0 += tile_size)
+				{
+					const auto col1 = std::min(col0 + tile_size, cols);
+					const auto row1 = std::min(row0 + tile_size, n_rows);
+
+					for (std::size_t col = col0; col < col1; ++col)
+						for (std::size_t row = row0; row < row1; ++row)
+						{
+							const auto index = row + col * n_rows;
+							for (std::size_t b = 0; b < n_bands; ++b)
+								store(band + b, index, slab[col + row * cols + b * n_slab_pixels]);
+						}
+				}
+		}
+	}
+
+	// A slab is a single line stored band by band
+	template<class Store_fn>
+	void read_bil(std::size_t first_row, std::size_t n_rows, Store_fn store)
+	{
+		const auto cols = format_.cols;
+		const auto bands = format_.bands;
+
+		values_.resize(bands * cols);
+		for (std::size_t row = 0; row < n_rows; ++row)
+		{
+			read_samples((first_row + row) * bands * cols, bands * cols, 0);
+
+			const auto slab = values_.data();
+			for (std::size_t col0 = 0; col0 < cols; col0 += tile_size)
+				for (std::size_t band0 = 0; band0 < bands; band0 += tile_size)
+				{
+					const auto col1 = std::min(col0 + tile_size, cols);
+					const auto band1 = std::min(band0 + tile_size, bands);
+
+					for (std::size_t col = col0; col < col1; ++col)
+						for (std::size_t band = band0; band < band1; ++band)
+							store(band, row + col * n_rows, slab[col + band * cols]);
+				}
+		}
+	}
+
+	// A slab is a single line stored pixel by pixel,
+	// pixel spectra are copied as is
+	template<class Store_fn>
+	void read_bip(std::size_t first_row, std::size_t n_rows, Store_fn store)
+	{
+		const auto cols = format_.cols;
+		const auto bands = format_.bands;
+
+		values_.resize(bands * cols);
+		for (std::size_t row = 0; row < n_rows; ++row)
+		{
+			read_samples((first_row + row) * bands * cols, bands * cols, 0);
+
+			const auto slab = values_.data();
+			for (std::size_t col = 0; col < cols; ++col)
+				for (std::size_t band = 0; band < bands; ++band)
+					store(band, row + col * n_rows, slab[band + col * bands]);
+		}
+	}
+
+private:
+	static constexpr std::size_t bands_per_slab = 8;
+	static constexpr std::size_t tile_size = 32;
+
+	const Raw_cube_format format_;
+	std::ifstream file_;
+	std::vector<unsigned char> bytes_;
+	std::vector<double> values_;
+};
+} // namespace internal
+
+// Reads a raw hyperspectral cube in the BSQ, BIL or BIP format
+Spectral_image read_raw_image(const std::string& file_name, const Raw_cube_format& format)
+{
+	Spectral_image image;
+	image.rows = format.rows;
+	image.cols = format.cols;
+	image.spectrum_size = format.bands;
+
+	internal::Raw_cube_reader reader(file_name, format);
+	reader.read(image.data);
+
+	return image;
+}
+
+Spectral_image read_envi_image(const std::string& data_file_name, const std::string& header_file_name)
+{
+	return read_raw_image(data_file_name, read_envi_header(header_file_name));
+}
+
+// Reads a raw hyperspectral cube applying the pre-processing stage on the fly
+Spectral_image read_raw_image(
+	const std::string& file_name, const Raw_cube_format& format, const Spectral_preprocessor& preprocessor)
+{
+	Spectral_image image;
+	image.rows = format.rows;
+	image.cols = format.cols;
+	image.spectrum_size = preprocessor.output_size();
+
+	internal::Raw_cube_reader reader(file_name, format);
+	reader.read(image.data, preprocessor);
+
+	return image;
+}
+
+// Reads a raw hyperspectral cube tile by tile, each tile contains
+// whole lines of (at least) n_pixels_per_tile pixels; if the pre-processing
+// stage is given, tiles contain reduced spectra
+class Raw_image_tile_reader
+{
+public:
+	Raw_image_tile_reader(const std::string& file_name, const Raw_cube_format& format, std::size_t n_pixels_per_tile) :
+		format_(format), reader_(file_name, format),
+		rows_per_tile_(std::max<std::size_t>(1, n_pixels_per_tile / format.cols))
+	{}
+
+	Raw_image_tile_reader(const std::string& file_name, const Raw_cube_format& format, std::size_t n_pixels_per_tile,
+		const Spectral_preprocessor& preprocessor) :
+		Raw_image_tile_reader(file_name, format, n_pixels_per_tile)
+	{
+		if (format_.bands != preprocessor.input_size())
+			throw std::runtime_error("Inconsistent spectrum size of raw cube");
+		preprocessor_ = &preprocessor;
+	}
+
+	std::size_t rows() const
+	{
+		return format_.rows;
+	}
+
+	std::size_t cols() const
+	{
+		return format_.cols;
+	}
+
+	std::size_t spectrum_size() const
+	{
+		return preprocessor_ ? preprocessor_->output_size() : format_.bands;
+	}
+
+	// Returns false if there are no more tiles
+	bool next(Image_tile& tile)
+	{
+		if (next_row_ >= format_.rows)
+			return false;
+
+		tile.first_row = next_row_;
+		tile.first_col = 0;
+		tile.rows = std::min(rows_per_tile_, format_.rows - next_row_);
+		tile.cols = format_.cols;
+		next_row_ += tile.rows;
+
+		if (preprocessor_)
+			reader_.read_lines(tile.first_row, tile.rows, tile.data, *preprocessor_);
+		else
+			reader_.read_lines(tile.first_row, tile.rows, tile.data);
+		return true;
+	}
+
+private:
+	const Raw_cube_format format_;
+	internal::Raw_cube_reader reader_;
+	const std::size_t rows_per_tile_;
+	const Spectral_preprocessor* preprocessor_ = nullptr;
+	std::size_t next_row_ = 0;
+};
@@ -0,0 +1,149 @@
+#pragma once
+#include "layer.hpp"
+#include "neural_network.hpp"
+#include "spectral_train_set.hpp"
+
+#include <esu/timer.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <exception>
+#include <iomanip>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+struct Sweep_config
+{
+	std::size_t n_kernels;
+	std::size_t kernel_size;
+	std::size_t pooling_size;
+	std::size_t n_fc_nodes;
+	double rate;
+	unsigned int n_iters;
+};
+
+struct Sweep_result
+{
+	Sweep_config config;
+	double loss;
+	double accuracy;
+	double seconds;
+};
+
+// Returns the Cartesian product of the given hyperparameter values
+inline std::vector<Sweep_config> make_sweep_grid(const std::vector<std::size_t>& n_kernels,
+	const std::vector<std::size_t>& kernel_sizes, const std::vector<std::size_t>& pooling_sizes,
+	const std::vector<std::size_t>& n_fc_nodes, const std::vector<double>& rates, unsigned int n_iters)
+{
+	std::vector<Sweep_config> configs;
+	for (auto nk : n_kernels)
+		for (auto ks : kernel_sizes)
+			for (auto ps : pooling_sizes)
+				for (auto nf : n_fc_nodes)
+					for (auto r : rates)
+						configs.push_back({nk, ks, ps, nf, r, n_iters});
+	return configs;
+}
+
+// Trains networks with the given configurations concurrently, each network
+// is trained by n_threads_per_network threads and all of them share the
+// same training set; accuracy is measured on the validation set; if a network
+// fails to train, the other runners stop after their current networks, and
+// the first exception is rethrown after they have finished
+inline std::vector<Sweep_result> run_sweep(const Spectral_train_set& train_set,
+	const Spectral_train_set& validation_set, const std::vector<Sweep_config>& configs,
+	unsigned int n_threads_per_network = 1)
+{
+	assert(n_threads_per_network > 0);
+	assert(validation_set.spectrum_size == train_set.spectrum_size);
+
+	for (const auto& config : configs)
+		if (config.n_iters == 0)
+			throw std::runtime_error("Number of iterations should be positive");
+
+	std::vector<Sweep_result> results(configs.size());
+	std::atomic<std::size_t> next_config{0};
+
+	std::exception_ptr error;
+	std::mutex error_mutex;
+	std::atomic<bool> failed{false};
+
+	const auto run = [&]()
+	{
+		try
+		{
+			for (auto i = next_config++; i < configs.size() && !failed; i = next_config++)
+			{
+				const auto& config = configs[i];
+
+				auto network = make_neural_network(Conv_layer(config.n_kernels, config.kernel_size),
+					Pooling_layer(config.pooling_size), Fc_layer(config.n_fc_nodes),
+					Output_layer(train_set.n_label_values));
+				network.set_n_threads(n_threads_per_network);
+				network.init(Random_init{.05}, train_set.spectrum_size);
+
+				esu::Timer tm;
+				tm.start();
+				const auto loss = network.train(train_set.data, train_set.labels, config.n_iters, config.rate);
+				tm.stop();
+
+				const auto labels = network.classify(validation_set.data);
+				std::size_t n_correct = 0;
+				for (std::size_t j = 0; j < labels.size(); ++j)
+					n_correct += (labels[j] == validation_set.labels[j]);
+
+				results[i] = {config, loss[loss.size() - 1], static_cast<double>(n_correct) / labels.size(), tm.sec()};
+			}
+		}
+		catch (...)
+		{
+			std::lock_guard lock(error_mutex);
+			if (!error)
+				error = std::current_exception();
+			failed = true;
+		}
+	};
+
+	const auto n_runners = std::max(1u, std::thread::hardware_concurrency() / n_threads_per_network);
+
+	std::vector<std::thread> runners;
+	for (unsigned int i = 0; i < std::min<std::size_t>(n_runners, configs.size()); ++i)
+		runners.emplace_back(run);
+
+	for (auto& r : runners)
+		r.join();
+
+	if (error)
+		std::rethrow_exception(error);
+
+	return results;
+}
+
+// Prints results in the order of decreasing accuracy
+inline void print_sweep_results(std::ostream& out, std::vector<Sweep_result> results)
+{
+	std::stable_sort(results.begin(), results.end(),
+		[](const Sweep_result& r1, const Sweep_result& r2) { return r1.accuracy > r2.accuracy; });
+
+	const auto flags = out.flags();
+	const auto precision = out.precision();
+
+	out << " kernels  kernel size  pooling  fc nodes    rate  iters        loss  accuracy     time, s\n";
+	for (const auto& r : results)
+	{
+		const auto& c = r.config;
+		out << std::defaultfloat << std::setprecision(4) << std::setw(8) << c.n_kernels << std::setw(13)
+			<< c.kernel_size << std::setw(9) << c.pooling_size << std::setw(10) << c.n_fc_nodes << std::setw(8)
+			<< c.rate << std::setw(7) << c.n_iters << std::fixed << std::setprecision(6) << std::setw(12) << r.loss
+			<< std::setprecision(4) << std::setw(10) << r.accuracy << std::setprecision(2) << std::setw(12)
+			<< r.seconds << '\n';
+	}
+
+	out.flags(flags);
+	out.precision(precision);
+}
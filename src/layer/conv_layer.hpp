@@ -36,6 +36,54 @@ public:
 
 	template<class In, class Out>
 	void compute_output(const In& in, Out& out) const
+	{
+		if (layout_ == Activation_layout::pixel_major)
+			compute_output_pixel_major(in, out);
+		else
+			compute_output_feature_major(in, out);
+	}
+
+	template<class In, class Out, class Out_grad>
+	void compute_gradient(const In& in, const Out& out, const Out_grad& out_grad, Parameters& params_grad) const
+	{
+		if (layout_ == Activation_layout::pixel_major)
+			compute_gradient_pixel_major(in, out, out_grad, params_grad);
+		else
+			compute_gradient_feature_major(in, out, out_grad, params_grad);
+	}
+
+	std::size_t output_size() const
+	{
+		return output_size_per_kernel_ * n_kernels_;
+	}
+
+	std::size_t output_size_per_kernel() const
+	{
+		return output_size_per_kernel_;
+	}
+
+	std::size_t n_kernels() const
+	{
+		return n_kernels_;
+	}
+
+	virtual std::string name() const override
+	{
+		return "Convolution layer";
+	}
+
+	std::string info_string() const
+	{
+		std::string info = name() + '\n';
+		info += "  Number of kernels: " + std::to_string(n_kernels_) + "\n";
+		info += "  Kernel size: " + std::to_string(kernel_size_) + "\n";
+		info += "  Number of trainable parameters: " + std::to_string(n_trainable_params()) + "\n";
+		return info;
+	}
+
+private:
+	template<class In, class Out>
+	void compute_output_feature_major(const In& in, Out& out) const
 	{
 		const auto n = in.cols();
 		out.resize(output_size(), in.cols());
@@ -77,7 +125,7 @@ public:
 	}
 
 	template<class In, class Out, class Out_grad>
-	void compute_gradient(const In& in, const Out& out, const Out_grad& out_grad, Parameters& params_grad) const
+	void compute_gradient_feature_major(const In& in, const Out& out, const Out_grad& out_grad, Parameters& params_grad) const
 	{
 		assert(in.cols() == out.cols());
 
@@ -102,36 +150,66 @@ public:
 		// TODO : use MKL
 	}
 
-	std::size_t output_size() const
+	// The input is always feature-major, it is transposed once per call
+	// so that the convolution becomes a sequence of broadcast-FMA loops
+	// over contiguous pixel columns
+	template<class In, class Out>
+	void compute_output_pixel_major(const In& in, Out& out) const
 	{
-		return output_size_per_kernel_ * n_kernels_;
-	}
+		const auto n = in.cols();
+		const esl::Matrix_xd in_tr = in.tr_view();
+		out.resize(n, output_size());
 
-	std::size_t output_size_per_kernel() const
-	{
-		return output_size_per_kernel_;
-	}
+		for (std::size_t k = 0; k < n_kernels_; ++k)
+			for (std::size_t i = 0; i < output_size_per_kernel_; ++i)
+			{
+				const auto col = i + k * output_size_per_kernel_;
+				for (std::size_t j = 0; j < n; ++j)
+					out(j, col) = params_.biases[k];
 
-	std::size_t n_kernels() const
-	{
-		return n_kernels_;
-	}
+				for (std::size_t p = 0; p < kernel_size_; ++p)
+				{
+					const auto w = params_.weights(k, p);
+					for (std::size_t j = 0; j < n; ++j)
+						out(j, col) += w * in_tr(j, i + p);
+				}
 
-	virtual std::string name() const override
-	{
-		return "Convolution layer";
+				for (std::size_t j = 0; j < n; ++j)
+					out(j, col) = std::tanh(out(j, col));
+			}
 	}
 
-	std::string info_string() const
+	template<class In, class Out, class Out_grad>
+	void compute_gradient_pixel_major(
+		const In& in, const Out& out, const Out_grad& out_grad, Parameters& params_grad) const
 	{
-		std::string info = name() + '\n';
-		info += "  Number of kernels: " + std::to_string(n_kernels_) + "\n";
-		info += "  Kernel size: " + std::to_string(kernel_size_) + "\n";
-		info += "  Number of trainable parameters: " + std::to_string(n_trainable_params()) + "\n";
-		return info;
+		assert(in.cols() == out.rows());
+
+		const auto n = in.cols();
+		const esl::Matrix_xd in_tr = in.tr_view();
+
+		esl::Matrix_xd m(n, out.cols());
+		for (std::size_t col = 0; col < out.cols(); ++col)
+			for (std::size_t j = 0; j < n; ++j)
+				m(j, col) = (1 - esu::sq(out(j, col))) * out_grad(j, col);
+
+		for (std::size_t k = 0; k < n_kernels_; ++k)
+			for (std::size_t i = 0; i < output_size_per_kernel_; ++i)
+			{
+				const auto col = i + k * output_size_per_kernel_;
+				for (std::size_t j = 0; j < n; ++j)
+					params_grad.biases[k] += m(j, col);
+
+				for (std::size_t p = 0; p < kernel_size_; ++p)
+				{
+					double sum = 0;
+					for (std::size_t j = 0; j < n; ++j)
+						sum += m(j, col) * in_tr(j, i + p);
+					params_grad.weights(k, p) += sum;
+				}
+			}
 	}
 
-private:
 	std::size_t get_output_size(std::size_t input_size) const
 	{
 		assert(input_size >= kernel_size_);
@@ -0,0 +1,92 @@
+#pragma once
+#include <esl/dense.hpp>
+
+#include <cassert>
+#include <cstddef>
+#include <vector>
+
+// Sparse matrix in the compressed sparse row format
+class Csr_matrix
+{
+public:
+	// Stores non-zero elements of the dense matrix
+	template<class Matrix>
+	explicit Csr_matrix(const Matrix& dense) : rows_(dense.rows()), cols_(dense.cols())
+	{
+		row_first_.reserve(rows_ + 1);
+		row_first_.push_back(0);
+		for (std::size_t row = 0; row < rows_; ++row)
+		{
+			for (std::size_t col = 0; col < cols_; ++col)
+				if (dense(row, col) != 0)
+				{
+					col_indices_.push_back(col);
+					values_.push_back(dense(row, col));
+				}
+			row_first_.push_back(values_.size());
+		}
+	}
+
+	std::size_t rows() const
+	{
+		return rows_;
+	}
+
+	std::size_t cols() const
+	{
+		return cols_;
+	}
+
+	std::size_t n_nonzeros() const
+	{
+		return values_.size();
+	}
+
+	// Computes out = this * in, a sparse dot product per element
+	template<class In, class Out>
+	void multiply(const In& in, Out& out) const
+	{
+		assert(in.rows() == cols_);
+		assert(out.rows() == rows_ && out.cols() == in.cols());
+
+		for (std::size_t j = 0; j < in.cols(); ++j)
+			for (std::size_t row = 0; row < rows_; ++row)
+			{
+				double sum = 0;
+				for (auto k = row_first_[row]; k < row_first_[row + 1]; ++k)
+					sum += values_[k] * in(col_indices_[k], j);
+				out(row, j) = sum;
+			}
+	}
+
+	// Computes out = in * this^T; each non-zero element adds a scaled column
+	// of the input to a column of the output, so the innermost loop is contiguous
+	template<class In, class Out>
+	void multiply_tr(const In& in, Out& out) const
+	{
+		assert(in.cols() == cols_);
+		assert(out.rows() == in.rows() && out.cols() == rows_);
+
+		const auto n = in.rows();
+		for (std::size_t row = 0; row < rows_; ++row)
+		{
+			for (std::size_t i = 0; i < n; ++i)
+				out(i, row) = 0;
+
+			for (auto k = row_first_[row]; k < row_first_[row + 1]; ++k)
+			{
+				const auto value = values_[k];
+				const auto col = col_indices_[k];
+				for (std::size_t i = 0; i < n; ++i)
+					out(i, row) += value * in(i, col);
+			}
+		}
+	}
+
+private:
+	std::size_t rows_;
+	std::size_t cols_;
+	std::vector<std::size_t> row_first_;
+	std::vector<std::size_t> col_indices_;
+	std::vector<double> values_;
+};
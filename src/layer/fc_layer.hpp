@@ -11,6 +11,9 @@
 
 class Fc_layer : public Trainable_layer
 {
+public:
+	static constexpr bool has_sparse_kernel = true;
+
 public:
 	explicit Fc_layer(std::size_t n_nodes) : n_nodes_(n_nodes)
 	{}
@@ -23,11 +26,53 @@ public:
 
 	template<class In, class Out>
 	void compute_output(const In& in, Out& out) const
+	{
+		if (layout_ == Activation_layout::pixel_major)
+			compute_output_pixel_major(in, out);
+		else
+			compute_output_feature_major(in, out);
+	}
+
+	template<class In, class Out, class In_grad, class Out_grad>
+	void compute_gradient(
+		const In& in, const Out& out, In_grad& in_grad, const Out_grad& out_grad, Parameters& params_grad) const
+	{
+		if (layout_ == Activation_layout::pixel_major)
+			compute_gradient_pixel_major(in, out, in_grad, out_grad, params_grad);
+		else
+			compute_gradient_feature_major(in, out, in_grad, out_grad, params_grad);
+	}
+
+	std::size_t output_size() const
+	{
+		return n_nodes_;
+	}
+
+	virtual std::string name() const override
+	{
+		return "Fully connected layer";
+	}
+
+	std::string info_string() const
+	{
+		std::string info = name() + '\n';
+		info += "  Number of nodes: " + std::to_string(n_nodes_) + "\n";
+		info += "  Number of trainable parameters: " + std::to_string(n_trainable_params()) + "\n";
+		info += pruning_info_string();
+		return info;
+	}
+
+private:
+	template<class In, class Out>
+	void compute_output_feature_major(const In& in, Out& out) const
 	{
 		const auto n = in.cols();
 
 		out.resize(n_nodes_, n);
-		out = params_.weights * in;
+		if (sparse_weights_)
+			sparse_weights_->multiply(in, out);
+		else
+			out = params_.weights * in;
 
 		for (std::size_t j = 0; j < n; ++j)
 			out.col_view(j) += params_.biases;
@@ -38,7 +83,7 @@ public:
 	}
 
 	template<class In, class Out, class In_grad, class Out_grad>
-	void compute_gradient(
+	void compute_gradient_feature_major(
 		const In& in, const Out& out, In_grad& in_grad, const Out_grad& out_grad, Parameters& params_grad) const
 	{
 		assert(out.cols() == in.cols());
@@ -56,25 +101,46 @@ public:
 			params_grad.biases += jacobian.col_view(j);
 	}
 
-	std::size_t output_size() const
+	// In the pixel-major layout activations are stored transposed,
+	// out = in * weights^T
+	template<class In, class Out>
+	void compute_output_pixel_major(const In& in, Out& out) const
 	{
-		return n_nodes_;
-	}
+		const auto n = in.rows();
 
-	virtual std::string name() const override
-	{
-		return "Fully connected layer";
+		out.resize(n, n_nodes_);
+		if (sparse_weights_)
+			sparse_weights_->multiply_tr(in, out);
+		else
+			out = in * params_.weights.tr_view();
+
+		for (std::size_t i = 0; i < n_nodes_; ++i)
+			for (std::size_t j = 0; j < n; ++j)
+				out(j, i) = std::tanh(out(j, i) + params_.biases[i]);
 	}
 
-	std::string info_string() const
+	template<class In, class Out, class In_grad, class Out_grad>
+	void compute_gradient_pixel_major(
+		const In& in, const Out& out, In_grad& in_grad, const Out_grad& out_grad, Parameters& params_grad) const
 	{
-		std::string info = name() + '\n';
-		info += "  Number of nodes: " + std::to_string(n_nodes_) + "\n";
-		info += "  Number of trainable parameters: " + std::to_string(n_trainable_params()) + "\n";
-		return info;
+		assert(out.rows() == in.rows());
+		assert(out_grad.rows() == in.rows());
+
+		const auto n = in.rows();
+		in_grad.resize(n, in.cols());
+
+		esl::Matrix_xd jacobian = out_grad;
+		for (std::size_t i = 0; i < n_nodes_; ++i)
+			for (std::size_t j = 0; j < n; ++j)
+			{
+				jacobian(j, i) *= (1 - esu::sq(out(j, i)));
+				params_grad.biases[i] += jacobian(j, i);
+			}
+
+		in_grad = jacobian * params_.weights;
+		params_grad.weights += jacobian.tr_view() * in;
 	}
 
-private:
 	template<class Out>
 	esl::Matrix_xd compute_jacobian(esl::Matrix_xd out_grad, const Out& out) const
 	{
@@ -1,25 +1,71 @@
 #pragma once
+#include "csr_matrix.hpp"
 #include "parameters.hpp"
 
+#include <algorithm>
+#include <cassert>
 #include <cmath>
 #include <cstddef>
-#include <iostream>
+#include <istream>
+#include <iterator>
+#include <numeric>
+#include <optional>
+#include <ostream>
 #include <stdexcept>
 #include <string>
+#include <vector>
+
+struct Empty_cache
+{};
+
+// Storage layout of hidden layer activations; the network input
+// and the output layer activations are always feature-major
+enum class Activation_layout
+{
+	// One column per pixel, features of a pixel are contiguous
+	feature_major,
+	// One row per pixel, values of a feature for all pixels are contiguous,
+	// so that elementwise operations vectorize across pixels
+	pixel_major
+};
 
 class Layer
 {
 public:
 	using Parameters = Empty_parameters;
+	using Cache = Empty_cache;
+
+	// Whether the layer can use sparse weights of a pruned network
+	static constexpr bool has_sparse_kernel = false;
 
 public:
 	virtual std::string name() const = 0;
+
+	void set_layout(Activation_layout layout)
+	{
+		layout_ = layout;
+	}
+
+	Activation_layout layout() const
+	{
+		return layout_;
+	}
+
+	void save(std::ostream&) const
+	{}
+
+	void load(std::istream&)
+	{}
+
+protected:
+	Activation_layout layout_ = Activation_layout::feature_major;
 };
 
-class Trainable_layer : Layer
+class Trainable_layer : public Layer
 {
 public:
 	using Parameters = Trainable_parameters;
+	using Cache = Empty_cache;
 
 public:
 	void reset(Parameters& params) const
@@ -31,55 +77,164 @@ public:
 		params.biases = 0;
 	}
 
+	void save(std::ostream& out) const
+	{
+		const auto precision = out.precision(17);
+		out << params_.weights.rows() << ' ' << params_.weights.cols() << '\n';
+		for (std::size_t row = 0; row < params_.weights.rows(); ++row)
+		{
+			for (std::size_t col = 0; col < params_.weights.cols(); ++col)
+				out << params_.weights(row, col) << ' ';
+			out << params_.biases[row] << '\n';
+		}
+
+		out << pruned_.size();
+		for (auto i : pruned_)
+			out << ' ' << i;
+		out << '\n';
+
+		out.precision(precision);
+	}
+
+	// Reads parameters and indices of pruned weights into the already initialized storage
+	void load(std::istream& in)
+	{
+		std::size_t rows, cols;
+		in >> rows >> cols;
+		if (!in || rows != params_.weights.rows() || cols != params_.weights.cols())
+			throw std::runtime_error(name() + ": inconsistent parameters size");
+
+		for (std::size_t row = 0; row < rows; ++row)
+		{
+			for (std::size_t col = 0; col < cols; ++col)
+				in >> params_.weights(row, col);
+			in >> params_.biases[row];
+		}
+
+		std::size_t n_pruned = 0;
+		in >> n_pruned;
+		if (!in || n_pruned > params_.weights.size())
+			throw std::runtime_error(name() + ": bad parameters data");
+
+		pruned_.resize(n_pruned);
+		for (std::size_t i = 0; i < n_pruned; ++i)
+		{
+			in >> pruned_[i];
+			if (!in || pruned_[i] >= params_.weights.size() || (i > 0 && pruned_[i] <= pruned_[i - 1]))
+				throw std::runtime_error(name() + ": bad pruned weights data");
+		}
+
+		zero_pruned();
+		sparse_weights_.reset();
+	}
+
+	const Parameters& params() const
+	{
+		return params_;
+	}
+
+	// Parameter updates keep pruned weights zero and drop sparse weights
+	void set_params(const Parameters& params)
+	{
+		assert(params.weights.rows() == params_.weights.rows() && params.weights.cols() == params_.weights.cols());
+		params_ = params;
+		zero_pruned();
+		sparse_weights_.reset();
+	}
+
 	void add_params(double alpha, const Parameters& params)
 	{
 		params_.weights += alpha * params.weights;
 		params_.biases += alpha * params.biases;
+		zero_pruned();
+		sparse_weights_.reset();
 	}
 
-	template<class Loss_fn, class Grad>
-	void check_gradient(const Loss_fn& loss_fn, const Grad& grad, double d = 1e-4)
+	// Lock-free update for asynchronous training, each parameter is updated
+	// with relaxed atomic load and store, so concurrent updates may be lost;
+	// sparse weights should be dropped before concurrent updates start
+	void add_params_relaxed(double alpha, const Parameters& params)
 	{
-		const auto loss0 = loss_fn();
-		for (std::size_t col = 0; col < params_.weights.cols(); ++col)
-			for (std::size_t row = 0; row < params_.weights.rows(); ++row)
-			{
-				params_.weights(row, col) += d;
-				const auto fd_grad = (loss_fn() - loss0) / d;
-				params_.weights(row, col) -= d;
+		add_relaxed(alpha, params.weights.data(), params_.weights.data(), params_.weights.size());
+		add_relaxed(alpha, params.biases.data(), params_.biases.data(), params_.biases.size());
 
-				const auto an_grad = grad.weights(row, col);
+		const double zero = 0;
+		for (auto i : pruned_)
+			__atomic_store(params_.weights.data() + i, &zero, __ATOMIC_RELAXED);
+	}
 
-				if (row == 2 && col == 1)
-				{
-					std::cout << "Expected value: " << an_grad << '\n'
-							  << "Finite difference value: " << fd_grad << std::endl;
-				}
+	// Sets the given fraction of weights with the smallest magnitudes to zero;
+	// weights pruned before are counted in the fraction
+	void prune(double fraction)
+	{
+		assert(fraction >= 0 && fraction <= 1);
 
-				const auto beta = std::abs(fd_grad - an_grad) / (std::abs(fd_grad) + std::abs(an_grad));
-				// if (beta > 100 * d && std::abs(an_grad) > 100 * d && std::abs(fd_grad) > 100 * d)
-				// {
-				// 	std::cout << "Expected value: " << an_grad << '\n'
-				// 			  << "Finite difference value: " << fd_grad << std::endl;
-				// 	throw std::runtime_error(name() + ": bad weights gradient");
-				// }
-			}
+		const auto weights = params_.weights.data();
+		const auto n_pruned = static_cast<std::size_t>(fraction * params_.weights.size());
+		if (n_pruned <= pruned_.size())
+			return;
 
-		for (std::size_t row = 0; row < params_.weights.rows(); ++row)
-		{
-			params_.biases[row] += d;
-			const auto fd_grad = (loss_fn() - loss0) / d;
-			params_.biases[row] -= d;
-
-			const auto an_grad = grad.biases[row];
-			const auto beta = std::abs(fd_grad - an_grad) / (std::abs(fd_grad) + std::abs(an_grad));
-			// if (beta > 100 * d && std::abs(an_grad) > 100 * d && std::abs(fd_grad) > 100 * d)
-			// {
-			// 	std::cout << "Expected value: " << an_grad << '\n'
-			// 			  << "Finite difference value: " << fd_grad << std::endl;
-			// 	throw std::runtime_error(name() + ": bad biases gradient");
-			// }
-		}
+		// Pruned weights are zero, so they are among the smallest ones
+		std::vector<std::size_t> indices(params_.weights.size());
+		std::iota(indices.begin(), indices.end(), std::size_t{0});
+		std::nth_element(indices.begin(), indices.begin() + n_pruned, indices.end(),
+			[weights](std::size_t i1, std::size_t i2) { return std::abs(weights[i1]) < std::abs(weights[i2]); });
+
+		indices.resize(n_pruned);
+		std::sort(indices.begin(), indices.end());
+
+		std::vector<std::size_t> pruned;
+		std::set_union(pruned_.begin(), pruned_.end(), indices.begin(), indices.end(), std::back_inserter(pruned));
+		pruned_ = std::move(pruned);
+
+		zero_pruned();
+		sparse_weights_.reset();
+	}
+
+	// Fraction of weights that have not been pruned
+	double density() const
+	{
+		return 1 - static_cast<double>(pruned_.size()) / params_.weights.size();
+	}
+
+	// Builds sparse weights if the density is low enough for the sparse
+	// kernel to be faster than the dense one, and drops them otherwise
+	void update_sparse_weights()
+	{
+		if (density() <= max_sparse_density)
+			sparse_weights_.emplace(params_.weights);
+		else
+			sparse_weights_.reset();
+	}
+
+	void drop_sparse_weights()
+	{
+		sparse_weights_.reset();
+	}
+
+	std::size_t n_trainable_params() const
+	{
+		return params_.weights.size() + params_.biases.size();
+	}
+
+	// Adds delta to the parameter with the given index;
+	// weights (in column-major order) precede biases
+	void perturb_param(std::size_t index, double delta)
+	{
+		sparse_weights_.reset();
+		if (index < params_.weights.size())
+			params_.weights.data()[index] += delta;
+		else
+			params_.biases[index - params_.weights.size()] += delta;
+	}
+
+	// Returns the parameter with the given index in the same order
+	static double param(const Parameters& params, std::size_t index)
+	{
+		if (index < params.weights.size())
+			return params.weights.data()[index];
+		else
+			return params.biases[index - params.weights.size()];
 	}
 
 protected:
@@ -91,13 +246,43 @@ protected:
 
 		params_.biases.resize(n_rows);
 		init_strategy(params_.biases);
+
+		pruned_.clear();
+		sparse_weights_.reset();
 	}
 
-	std::size_t n_trainable_params() const
+	std::string pruning_info_string() const
 	{
-		return params_.weights.size() + params_.biases.size();
+		if (pruned_.empty())
+			return {};
+		return "  Density of weights: " + std::to_string(density()) + (sparse_weights_ ? ", sparse kernel\n" : "\n");
+	}
+
+	void zero_pruned()
+	{
+		for (auto i : pruned_)
+			params_.weights.data()[i] = 0;
+	}
+
+	static void add_relaxed(double alpha, const double* x, double* y, std::size_t n)
+	{
+		for (std::size_t i = 0; i < n; ++i)
+		{
+			double value;
+			__atomic_load(y + i, &value, __ATOMIC_RELAXED);
+			value += alpha * x[i];
+			__atomic_store(y + i, &value, __ATOMIC_RELAXED);
+		}
 	}
 
 protected:
+	// Dense kernels are faster unless most weights are zero
+	static constexpr double max_sparse_density = .2;
+
 	Parameters params_;
+
+	// Indices of pruned weights (in column-major order), sorted
+	std::vector<std::size_t> pruned_;
+	// Copy of weights in the sparse format, used for the forward pass if engaged
+	std::optional<Csr_matrix> sparse_weights_;
 };
@@ -3,6 +3,7 @@
 
 #include <esl/dense.hpp>
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <cstddef>
@@ -10,6 +11,9 @@
 
 class Output_layer : public Trainable_layer
 {
+public:
+	static constexpr bool has_sparse_kernel = true;
+
 public:
 	explicit Output_layer(std::size_t n_nodes) : n_nodes_(n_nodes)
 	{}
@@ -20,59 +24,119 @@ public:
 		init_storage(n_nodes_, prev_layer.output_size(), init_strategy);
 	}
 
+	// Computes softmax probabilities; the output is always feature-major
 	template<class Input, class Output>
 	void compute_output(const Input& in, Output& out) const
 	{
-		const auto n = in.cols();
+		compute_logits(in, out);
+		for (std::size_t j = 0; j < out.cols(); ++j)
+			softmax(out.col_view(j));
+	}
+
+	// Computes logits only, the input is transposed
+	// if the pixel-major layout is used
+	template<class Input, class Output>
+	void compute_logits(const Input& in, Output& out) const
+	{
+		const auto n = n_samples(in);
 
 		out.resize(n_nodes_, n);
-		out = params_.weights * in;
+		if (sparse_weights_)
+		{
+			if (layout_ == Activation_layout::pixel_major)
+				sparse_weights_->multiply(in.tr_view(), out);
+			else
+				sparse_weights_->multiply(in, out);
+		}
+		else if (layout_ == Activation_layout::pixel_major)
+			out = params_.weights * in.tr_view();
+		else
+			out = params_.weights * in;
 
 		for (std::size_t j = 0; j < n; ++j)
-		{
 			out.col_view(j) += params_.biases;
+	}
 
-			double norm = 0;
-			for (std::size_t i = 0; i < n_nodes_; ++i)
-			{
-				out(i, j) = std::exp(out(i, j));
-				norm += out(i, j);
-			}
+	// Transforms logits into probabilities in place
+	template<class Logits>
+	static void softmax(Logits&& logits, double temperature = 1)
+	{
+		// The maximum logit is subtracted to avoid overflow in exp()
+		double max = logits[0];
+		for (std::size_t i = 1; i < logits.size(); ++i)
+			max = std::max(max, logits[i]);
 
-			out.col_view(j) /= norm;
+		double norm = 0;
+		for (std::size_t i = 0; i < logits.size(); ++i)
+		{
+			logits[i] = std::exp((logits[i] - max) / temperature);
+			norm += logits[i];
 		}
+
+		for (std::size_t i = 0; i < logits.size(); ++i)
+			logits[i] /= norm;
 	}
 
-	template<class In, class Out, class In_grad, class Out_grad>
+	// Computes the gradient of the cross-entropy loss function with respect
+	// to logits (the training output) directly as (probabilities - one-hot labels)
+	template<class In, class Logits, class Labels, class In_grad>
 	void compute_gradient(
-		const In& in, const Out& out, In_grad& in_grad, const Out_grad& out_grad, Parameters& params_grad) const
+		const In& in, const Logits& logits, const Labels& labels, In_grad& in_grad, Parameters& params_grad) const
 	{
-		assert(in.cols() == out.cols());
-		assert(out_grad.cols() == in.cols());
-
-		const auto n = in.cols();
-		in_grad.resize(in.rows(), n);
+		const auto n = n_samples(in);
+		assert(logits.cols() == n);
+		assert(labels.size() == n);
 
-		esl::Matrix_xd m = out_grad;
+		esl::Matrix_xd m = logits;
 		for (std::size_t j = 0; j < n; ++j)
-			for (std::size_t i = 0; i < n_nodes_; ++i)
-				m(i, j) *= out(i, j);
+		{
+			softmax(m.col_view(j));
+			m(labels[j], j) -= 1;
+			params_grad.biases += m.col_view(j);
+		}
 
-		esl::Matrix_xd m2 = m;
-		for (std::size_t j = 0; j < n; ++j)
+		if (layout_ == Activation_layout::pixel_major)
 		{
-			const auto sum = esl::sum(m.col_view(j));
-			m2.col_view(j) -= sum * out.col_view(j);
+			in_grad.resize(n, in.cols());
+			in_grad = m.tr_view() * params_.weights;
+			params_grad.weights += m * in;
 		}
+		else
+		{
+			in_grad.resize(in.rows(), n);
+			in_grad = params_.weights.tr_view() * m;
+			params_grad.weights += m * in.tr_view();
+		}
+	}
 
-		in_grad = params_.weights.tr_view() * m2;
-		params_grad.weights += m2 * in.tr_view();
+	// Returns the cross-entropy loss function summed over samples; it is computed
+	// from logits as log(sum(exp(logits))) - logits[label], so that it stays exact
+	// when the probability of the true label underflows
+	template<class Logits, class Labels>
+	double loss(const Logits& logits, const Labels& labels) const
+	{
+		assert(logits.cols() == labels.size());
 
-		for (std::size_t j = 0; j < n; ++j)
-			params_grad.biases += m.col_view(j);
-		auto m1 = (out * m.tr_view()).eval();
-		for (std::size_t i = 0; i < n_nodes_; ++i)
-			params_grad.biases -= m1.col_view(i);
+		double loss = 0;
+		for (std::size_t j = 0; j < labels.size(); ++j)
+		{
+			double max = logits(0, j);
+			for (std::size_t i = 1; i < logits.rows(); ++i)
+				max = std::max(max, logits(i, j));
+
+			double sum = 0;
+			for (std::size_t i = 0; i < logits.rows(); ++i)
+				sum += std::exp(logits(i, j) - max);
+
+			loss += max + std::log(sum) - logits(labels[j], j);
+		}
+		return loss;
+	}
+
+	// Number of classes
+	std::size_t output_size() const
+	{
+		return n_nodes_;
 	}
 
 	virtual std::string name() const override
@@ -85,9 +149,17 @@ public:
 		std::string info = name() + '\n';
 		info += "  Number of nodes: " + std::to_string(n_nodes_) + "\n";
 		info += "  Number of trainable parameters: " + std::to_string(n_trainable_params()) + "\n";
+		info += pruning_info_string();
 		return info;
 	}
 
+private:
+	template<class Input>
+	std::size_t n_samples(const Input& in) const
+	{
+		return (layout_ == Activation_layout::pixel_major) ? in.rows() : in.cols();
+	}
+
 private:
 	const std::size_t n_nodes_;
 };
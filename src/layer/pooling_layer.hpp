@@ -2,104 +2,332 @@
 #include "layer.hpp"
 #include <esl/dense.hpp>
 
+#include <algorithm>
 #include <cassert>
 #include <cstddef>
+#include <string>
+
+enum class Pooling_type
+{
+	max,
+	average
+};
 
 class Pooling_layer : public Layer
 {
 public:
-	explicit Pooling_layer(std::size_t pooling_size) : pooling_size_(pooling_size)
+	// Row indices of maximum input values, one per output value
+	using Cache = esl::Matrix_x<std::size_t>;
+
+public:
+	explicit Pooling_layer(std::size_t pooling_size, Pooling_type type = Pooling_type::max) :
+		Pooling_layer(pooling_size, pooling_size, type)
 	{}
 
+	Pooling_layer(std::size_t pooling_size, std::size_t stride, Pooling_type type = Pooling_type::max) :
+		pooling_size_(pooling_size), stride_(stride), type_(type)
+	{
+		assert(pooling_size_ > 0 && stride_ > 0);
+	}
+
 	template<class Strategy, class Layer>
 	void init(Strategy&&, const Layer& prev_layer)
 	{
-		const auto input_size_per_kernel = prev_layer.output_size_per_kernel();
-		const auto output_size_per_kernel = get_output_size(input_size_per_kernel);
+		input_size_per_kernel_ = prev_layer.output_size_per_kernel();
+		output_size_per_kernel_ = get_output_size(input_size_per_kernel_);
 		n_kernels_ = prev_layer.n_kernels();
-		output_size_ = output_size_per_kernel * n_kernels_;
 	}
 
+	// Inference forward pass, maximum positions are not stored
 	template<class In, class Out>
 	void compute_output(const In& in, Out& out) const
 	{
-		const auto input_size = in.rows();
-		const auto input_size_per_kernel = input_size / n_kernels_;
-		const auto output_size_per_kernel = output_size_ / n_kernels_;
+		if (layout_ == Activation_layout::pixel_major)
+			compute_output_pixel_major(in, out);
+		else
+			compute_output_feature_major(in, out);
+	}
+
+	// Training forward pass, maximum positions are stored in the cache
+	// to be used in the backward pass
+	template<class In, class Out>
+	void compute_output(const In& in, Out& out, Cache& max_indices) const
+	{
+		if (type_ == Pooling_type::average)
+			compute_output(in, out);
+		else if (layout_ == Activation_layout::pixel_major)
+			compute_output_pixel_major(in, out, max_indices);
+		else
+			compute_output_feature_major(in, out, max_indices);
+	}
+
+	template<class In, class Out, class In_grad, class Out_grad>
+	void compute_gradient(
+		const In& in, const Out& out, const Cache& max_indices, In_grad& in_grad, const Out_grad& out_grad) const
+	{
+		if (layout_ == Activation_layout::pixel_major)
+			compute_gradient_pixel_major(in, out, max_indices, in_grad, out_grad);
+		else
+			compute_gradient_feature_major(in, out, max_indices, in_grad, out_grad);
+	}
+
+	std::size_t output_size() const
+	{
+		return output_size_per_kernel_ * n_kernels_;
+	}
+
+	virtual std::string name() const override
+	{
+		return "Pooling layer";
+	}
+
+	std::string info_string() const
+	{
+		std::string info = name() + '\n';
+		info += "  Pooling type: ";
+		info += (type_ == Pooling_type::max) ? "max\n" : "average\n";
+		info += "  Pooling size: " + std::to_string(pooling_size_) + "\n";
+		info += "  Pooling stride: " + std::to_string(stride_) + "\n";
+		return info;
+	}
+
+private:
+	template<class In, class Out>
+	void compute_output_feature_major(const In& in, Out& out) const
+	{
+		assert(in.rows() == input_size_per_kernel_ * n_kernels_);
+		out.resize(output_size(), in.cols());
 
-		out.resize(output_size_, in.cols());
+		if (type_ == Pooling_type::average)
+		{
+			compute_average_feature_major(in, out);
+			return;
+		}
 
 		for (std::size_t col = 0; col < in.cols(); ++col)
 			for (std::size_t k = 0; k < n_kernels_; ++k)
-				for (std::size_t i = 0; i < output_size_per_kernel; ++i)
+			{
+				const auto in_first = k * input_size_per_kernel_;
+				const auto out_first = k * output_size_per_kernel_;
+
+				for (std::size_t i = 0; i < output_size_per_kernel_; ++i)
+					out(i + out_first, col) = in(i * stride_ + in_first, col);
+
+				// The loop over output positions is the innermost one
+				// to let the compiler vectorize it
+				for (std::size_t p = 1; p < pooling_size_; ++p)
+					for (std::size_t i = 0; i < output_size_per_kernel_; ++i)
+						out(i + out_first, col) = std::max(out(i + out_first, col), in(p + i * stride_ + in_first, col));
+			}
+	}
+
+	template<class In, class Out>
+	void compute_output_feature_major(const In& in, Out& out, Cache& max_indices) const
+	{
+		assert(in.rows() == input_size_per_kernel_ * n_kernels_);
+		out.resize(output_size(), in.cols());
+		max_indices.resize(output_size(), in.cols());
+
+		for (std::size_t col = 0; col < in.cols(); ++col)
+			for (std::size_t k = 0; k < n_kernels_; ++k)
+			{
+				const auto in_first = k * input_size_per_kernel_;
+				const auto out_first = k * output_size_per_kernel_;
+
+				for (std::size_t i = 0; i < output_size_per_kernel_; ++i)
 				{
-					auto max = in(i * pooling_size_ + k * input_size_per_kernel, col);
-					for (std::size_t p = 1; p < pooling_size_; ++p)
+					out(i + out_first, col) = in(i * stride_ + in_first, col);
+					max_indices(i + out_first, col) = i * stride_ + in_first;
+				}
+
+				// Branch-free selection, the first maximum wins
+				for (std::size_t p = 1; p < pooling_size_; ++p)
+					for (std::size_t i = 0; i < output_size_per_kernel_; ++i)
 					{
-						auto v = in(p + i * pooling_size_ + k * input_size_per_kernel, col);
-						max = std::max(max, v);
+						const auto index = p + i * stride_ + in_first;
+						const auto v = in(index, col);
+						const bool greater = v > out(i + out_first, col);
+
+						out(i + out_first, col) = greater ? v : out(i + out_first, col);
+						max_indices(i + out_first, col) = greater ? index : max_indices(i + out_first, col);
 					}
-					out(i + k * output_size_per_kernel, col) = max;
-				}
+			}
 	}
 
 	template<class In, class Out, class In_grad, class Out_grad>
-	void compute_gradient(const In& in, const Out& out, In_grad& in_grad, const Out_grad& out_grad) const
+	void compute_gradient_feature_major(
+		const In& in, const Out& out, const Cache& max_indices, In_grad& in_grad, const Out_grad& out_grad) const
 	{
 		assert(in.cols() == out.cols());
-
-		const auto input_size = in.rows();
-		const auto input_size_per_kernel = input_size / n_kernels_;
-		const auto output_size_per_kernel = output_size_ / n_kernels_;
+		assert(out_grad.cols() == out.cols());
 
 		in_grad.resize(in.rows(), in.cols());
 		in_grad = 0;
 
-		for (std::size_t col = 0; col < in.cols(); ++col)
-			for (std::size_t k = 0; k < n_kernels_; ++k)
-				for (std::size_t i = 0; i < output_size_per_kernel; ++i)
+		if (type_ == Pooling_type::average)
+		{
+			const auto scale = 1. / pooling_size_;
+			for (std::size_t col = 0; col < in.cols(); ++col)
+				for (std::size_t k = 0; k < n_kernels_; ++k)
 				{
-					std::size_t max_index = 0;
-					auto max = in(i * pooling_size_ + k * input_size_per_kernel, col);
-					for (std::size_t p = 1; p < pooling_size_; ++p)
+					const auto in_first = k * input_size_per_kernel_;
+					const auto out_first = k * output_size_per_kernel_;
+					for (std::size_t i = 0; i < output_size_per_kernel_; ++i)
 					{
-						auto v = in(p + i * pooling_size_ + k * input_size_per_kernel, col);
-						if (v > max)
-						{
-							max_index = p;
-							max = v;
-						}
+						const auto grad = scale * out_grad(i + out_first, col);
+						for (std::size_t p = 0; p < pooling_size_; ++p)
+							in_grad(p + i * stride_ + in_first, col) += grad;
 					}
-					in_grad(max_index + i * pooling_size_ + k * input_size_per_kernel, col) = out_grad(i + k * output_size_per_kernel, col);
 				}
+			return;
+		}
+
+		assert(max_indices.rows() == out.rows() && max_indices.cols() == out.cols());
+
+		// Pooling windows overlap if stride is less than pooling size,
+		// so gradients are accumulated
+		for (std::size_t col = 0; col < in.cols(); ++col)
+			for (std::size_t i = 0; i < out.rows(); ++i)
+				in_grad(max_indices(i, col), col) += out_grad(i, col);
 	}
 
-	std::size_t output_size() const
+	template<class In, class Out>
+	void compute_average_feature_major(const In& in, Out& out) const
 	{
-		return output_size_;
+		const auto scale = 1. / pooling_size_;
+		for (std::size_t col = 0; col < in.cols(); ++col)
+			for (std::size_t k = 0; k < n_kernels_; ++k)
+			{
+				const auto in_first = k * input_size_per_kernel_;
+				const auto out_first = k * output_size_per_kernel_;
+
+				for (std::size_t i = 0; i < output_size_per_kernel_; ++i)
+					out(i + out_first, col) = 0;
+
+				for (std::size_t p = 0; p < pooling_size_; ++p)
+					for (std::size_t i = 0; i < output_size_per_kernel_; ++i)
+						out(i + out_first, col) += in(p + i * stride_ + in_first, col);
+
+				for (std::size_t i = 0; i < output_size_per_kernel_; ++i)
+					out(i + out_first, col) *= scale;
+			}
 	}
 
-	virtual std::string name() const override
+	// In the pixel-major layout each output feature is computed
+	// by elementwise operations on contiguous pixel columns
+	template<class In, class Out>
+	void compute_output_pixel_major(const In& in, Out& out) const
 	{
-		return "Pooling layer";
+		assert(in.cols() == input_size_per_kernel_ * n_kernels_);
+
+		const auto n = in.rows();
+		out.resize(n, output_size());
+
+		const auto scale = 1. / pooling_size_;
+		for (std::size_t k = 0; k < n_kernels_; ++k)
+			for (std::size_t i = 0; i < output_size_per_kernel_; ++i)
+			{
+				const auto in_first = i * stride_ + k * input_size_per_kernel_;
+				const auto col = i + k * output_size_per_kernel_;
+
+				for (std::size_t j = 0; j < n; ++j)
+					out(j, col) = in(j, in_first);
+
+				if (type_ == Pooling_type::average)
+				{
+					for (std::size_t p = 1; p < pooling_size_; ++p)
+						for (std::size_t j = 0; j < n; ++j)
+							out(j, col) += in(j, p + in_first);
+
+					for (std::size_t j = 0; j < n; ++j)
+						out(j, col) *= scale;
+				}
+				else
+					for (std::size_t p = 1; p < pooling_size_; ++p)
+						for (std::size_t j = 0; j < n; ++j)
+							out(j, col) = std::max(out(j, col), in(j, p + in_first));
+			}
 	}
 
-	std::string info_string() const
+	template<class In, class Out>
+	void compute_output_pixel_major(const In& in, Out& out, Cache& max_indices) const
 	{
-		std::string info = name() + '\n';
-		info += "  Pooling size: " + std::to_string(pooling_size_) + "\n";
-		return info;
+		assert(in.cols() == input_size_per_kernel_ * n_kernels_);
+
+		const auto n = in.rows();
+		out.resize(n, output_size());
+		max_indices.resize(n, output_size());
+
+		for (std::size_t k = 0; k < n_kernels_; ++k)
+			for (std::size_t i = 0; i < output_size_per_kernel_; ++i)
+			{
+				const auto in_first = i * stride_ + k * input_size_per_kernel_;
+				const auto col = i + k * output_size_per_kernel_;
+
+				for (std::size_t j = 0; j < n; ++j)
+				{
+					out(j, col) = in(j, in_first);
+					max_indices(j, col) = in_first;
+				}
+
+				for (std::size_t p = 1; p < pooling_size_; ++p)
+					for (std::size_t j = 0; j < n; ++j)
+					{
+						const auto v = in(j, p + in_first);
+						const bool greater = v > out(j, col);
+
+						out(j, col) = greater ? v : out(j, col);
+						max_indices(j, col) = greater ? p + in_first : max_indices(j, col);
+					}
+			}
+	}
+
+	template<class In, class Out, class In_grad, class Out_grad>
+	void compute_gradient_pixel_major(
+		const In& in, const Out& out, const Cache& max_indices, In_grad& in_grad, const Out_grad& out_grad) const
+	{
+		assert(in.rows() == out.rows());
+		assert(out_grad.rows() == out.rows());
+
+		const auto n = in.rows();
+		in_grad.resize(n, in.cols());
+		in_grad = 0;
+
+		if (type_ == Pooling_type::average)
+		{
+			const auto scale = 1. / pooling_size_;
+			for (std::size_t k = 0; k < n_kernels_; ++k)
+				for (std::size_t i = 0; i < output_size_per_kernel_; ++i)
+				{
+					const auto in_first = i * stride_ + k * input_size_per_kernel_;
+					const auto col = i + k * output_size_per_kernel_;
+
+					for (std::size_t p = 0; p < pooling_size_; ++p)
+						for (std::size_t j = 0; j < n; ++j)
+							in_grad(j, p + in_first) += scale * out_grad(j, col);
+				}
+			return;
+		}
+
+		assert(max_indices.rows() == out.rows() && max_indices.cols() == out.cols());
+
+		for (std::size_t col = 0; col < out.cols(); ++col)
+			for (std::size_t j = 0; j < n; ++j)
+				in_grad(j, max_indices(j, col)) += out_grad(j, col);
 	}
 
-private:
 	std::size_t get_output_size(std::size_t input_size) const
 	{
 		assert(input_size >= pooling_size_);
-		return input_size / pooling_size_;
+		return (input_size - pooling_size_) / stride_ + 1;
 	}
 
 private:
 	const std::size_t pooling_size_;
-	std::size_t output_size_ = 0;
+	const std::size_t stride_;
+	const Pooling_type type_;
+
+	std::size_t input_size_per_kernel_ = 0;
+	std::size_t output_size_per_kernel_ = 0;
 	std::size_t n_kernels_ = 0;
 };
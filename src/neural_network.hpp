@@ -1,4 +1,5 @@
 #pragma once
 #include "neural_network/const_init.hpp"
+#include "neural_network/ensemble_classifier.hpp"
 #include "neural_network/neural_network.hpp"
 #include "neural_network/random_init.hpp"
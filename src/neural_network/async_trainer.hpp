@@ -0,0 +1,115 @@
+#pragma once
+#include "trainer.hpp"
+
+#include <esl/dense.hpp>
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+namespace internal
+{
+// Asynchronous (Hogwild-style) trainer: workers do not wait for each other,
+// each of them applies gradients computed on its slice of the training set
+// directly to the shared parameters as soon as the backward pass through
+// a layer is done; concurrent updates are lock-free and may occasionally
+// be lost, and the forward pass may see partially updated parameters
+template<class Network>
+class Async_trainer
+{
+public:
+	Async_trainer(Network& network) : network_(network)
+	{}
+
+	template<class In, class Labels, class Callback_fn>
+	esl::Vector_xd operator()(
+		const In& in, const Labels& labels, unsigned int n_iters, double rate, Callback_fn callback_fn)
+	{
+		assert(in.cols() == labels.size());
+		assert(labels.size() > 0);
+
+		const auto n_samples = labels.size();
+		const std::size_t n_threads = network_.n_threads();
+		const auto n_samples_per_worker = (n_samples + n_threads - 1) / n_threads;
+
+		// No worker gets an empty set of samples
+		const auto n_workers = (n_samples + n_samples_per_worker - 1) / n_samples_per_worker;
+
+		std::vector<std::thread> workers;
+
+		esl::Matrix_xd wrk_loss_function(n_workers, n_iters);
+		esl::Vector_xd loss_function(n_iters);
+		std::vector<std::atomic<std::size_t>> n_done_workers(n_iters);
+
+		// The last worker that completes an iteration computes the loss function;
+		// iterations are completed in order, so callback calls are ordered too
+		const auto on_iteration_done = [&](std::size_t worker, unsigned int it, double loss)
+		{
+			wrk_loss_function(worker, it) = loss;
+			if (n_done_workers[it].fetch_add(1, std::memory_order_acq_rel) + 1 < n_workers)
+				return;
+
+			loss_function[it] = 0;
+			for (std::size_t i = 0; i < n_workers; ++i)
+				loss_function[it] += wrk_loss_function(i, it);
+			loss_function[it] /= n_samples;
+
+			callback_fn(it, loss_function[it]);
+		};
+
+		for (std::size_t i = 0; i < n_workers; ++i)
+		{
+			const auto first = i * n_samples_per_worker;
+			const auto n = std::min(n_samples - first, n_samples_per_worker);
+
+			workers.emplace_back([&, n, first, i, this]()
+			{
+				with_worker_input(in.cols_view(first, n), i, network_.pin_threads_, [&](const auto& wrk_in)
+				{
+					train_step(wrk_in, labels.rows_view(first, n), -rate / n_samples, n_iters,
+						[&on_iteration_done, i](unsigned int it, double loss) { on_iteration_done(i, it, loss); });
+				});
+			});
+		}
+
+		for (auto& w : workers)
+			w.join();
+
+		return loss_function;
+	}
+
+private:
+	template<class In, class Labels, class Iteration_done_fn>
+	void train_step(const In& in, Labels labels, double alpha, unsigned int n_iters,
+		const Iteration_done_fn& on_iteration_done)
+	{
+		assert(in.cols() == labels.size());
+
+		typename Network::Layers_outputs outs;
+		typename Network::Layers_caches caches;
+		typename Network::Layers_outputs out_grads;
+		typename Network::Layers_parameters param_grads;
+
+		// Parameters of a layer are not used after its gradients have been computed,
+		// so they can be updated before the backward pass is finished
+		const auto on_layer_done = [this, alpha, &param_grads](auto index)
+		{
+			constexpr auto i = decltype(index)::value;
+			std::get<i>(network_.layers_).add_params_relaxed(alpha, std::get<i>(param_grads));
+		};
+
+		for (unsigned int it = 0; it < n_iters; ++it)
+		{
+			const auto loss_function =
+				network_.compute_loss_and_gradients(in, labels, outs, caches, out_grads, param_grads, on_layer_done);
+			on_iteration_done(it, loss_function);
+		}
+	}
+
+private:
+	Network& network_;
+};
+} // namespace internal
@@ -0,0 +1,200 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+struct Classification_cache_stats
+{
+	std::size_t n_samples = 0;
+	// Samples with all values equal to the no-data value
+	std::size_t n_no_data = 0;
+	// Samples whose spectra have been seen before
+	std::size_t n_hits = 0;
+	// Samples that have been classified by the network
+	std::size_t n_misses = 0;
+
+	double hit_rate() const
+	{
+		const auto n = n_hits + n_misses;
+		return n > 0 ? static_cast<double>(n_hits) / n : 0;
+	}
+};
+
+// Cache of labels keyed by spectrum hashes that can be shared by several
+// classifications (e.g., of overlapping scenes) and by several threads.
+// A spectrum is identified by two independent 64-bit hashes, collisions
+// of both are ignored. The number of cached spectra is bounded by the capacity.
+// Labels are valid for the network parameters they have been computed with,
+// so the cache should not be used by different networks concurrently.
+class Classification_cache
+{
+public:
+	explicit Classification_cache(std::size_t no_data_label, double no_data_value = 0) :
+		no_data_label_(no_data_label), no_data_value_(no_data_value)
+	{}
+
+	std::size_t no_data_label() const
+	{
+		return no_data_label_;
+	}
+
+	// Sets the maximum number of cached spectra, it is split evenly between shards;
+	// spectra are not inserted into a full shard, the existing ones are kept
+	void set_capacity(std::size_t capacity)
+	{
+		capacity_ = capacity;
+	}
+
+	std::size_t capacity() const
+	{
+		return capacity_;
+	}
+
+	// Drops cached labels if they have been computed with parameters
+	// of another version, see Neural_network::params_version()
+	void set_params_version(std::uint64_t params_version)
+	{
+		if (params_version == params_version_)
+			return;
+
+		clear_labels();
+		params_version_ = params_version;
+	}
+
+	// Number of cached spectra
+	std::size_t size() const
+	{
+		std::size_t size = 0;
+		for (auto& shard : shards_)
+		{
+			std::lock_guard lock(shard.mutex);
+			size += shard.labels.size();
+		}
+		return size;
+	}
+
+	template<class Spectrum>
+	bool is_no_data(const Spectrum& spectrum) const
+	{
+		for (std::size_t i = 0; i < spectrum.size(); ++i)
+			if (spectrum[i] != no_data_value_)
+				return false;
+		return true;
+	}
+
+	struct Key
+	{
+		std::uint64_t hash;
+		std::uint64_t check;
+	};
+
+	template<class Spectrum>
+	static Key key(const Spectrum& spectrum)
+	{
+		Key key{0x9e3779b97f4a7c15ull, 0xc2b2ae3d27d4eb4full};
+		for (std::size_t i = 0; i < spectrum.size(); ++i)
+		{
+			std::uint64_t word;
+			const double value = spectrum[i];
+			std::memcpy(&word, &value, sizeof(word));
+
+			key.hash = mix(key.hash ^ word);
+			key.check = mix(key.check + word * 0xff51afd7ed558ccdull);
+		}
+		return key;
+	}
+
+	// Returns true and the label if the spectrum with the given key is in the cache
+	bool find(const Key& key, std::size_t& label) const
+	{
+		const auto& shard = shards_[key.hash % n_shards];
+		std::lock_guard lock(shard.mutex);
+
+		const auto it = shard.labels.find(key.hash);
+		if (it == shard.labels.end() || it->second.first != key.check)
+			return false;
+
+		label = it->second.second;
+		return true;
+	}
+
+	void insert(const Key& key, std::size_t label)
+	{
+		auto& shard = shards_[key.hash % n_shards];
+		std::lock_guard lock(shard.mutex);
+
+		const auto it = shard.labels.find(key.hash);
+		if (it != shard.labels.end())
+			it->second = {key.check, label};
+		else if (shard.labels.size() < (capacity_ + n_shards - 1) / n_shards)
+			shard.labels.emplace(key.hash, std::pair{key.check, label});
+	}
+
+	void add_stats(std::size_t n_samples, std::size_t n_no_data, std::size_t n_hits, std::size_t n_misses)
+	{
+		n_samples_ += n_samples;
+		n_no_data_ += n_no_data;
+		n_hits_ += n_hits;
+		n_misses_ += n_misses;
+	}
+
+	Classification_cache_stats stats() const
+	{
+		return {n_samples_, n_no_data_, n_hits_, n_misses_};
+	}
+
+	void clear()
+	{
+		clear_labels();
+		n_samples_ = n_no_data_ = n_hits_ = n_misses_ = 0;
+	}
+
+private:
+	void clear_labels()
+	{
+		for (auto& shard : shards_)
+		{
+			std::lock_guard lock(shard.mutex);
+			shard.labels.clear();
+		}
+	}
+
+	static std::uint64_t mix(std::uint64_t x)
+	{
+		x ^= x >> 33;
+		x *= 0xff51afd7ed558ccdull;
+		x ^= x >> 33;
+		x *= 0xc4ceb9fe1a85ec53ull;
+		x ^= x >> 33;
+		return x;
+	}
+
+private:
+	// Hash map is split into independently locked shards
+	// to reduce contention between worker threads
+	static constexpr std::size_t n_shards = 64;
+
+	struct Shard
+	{
+		mutable std::mutex mutex;
+		std::unordered_map<std::uint64_t, std::pair<std::uint64_t, std::size_t>> labels;
+	};
+
+	const std::size_t no_data_label_;
+	const double no_data_value_;
+	// Hash map nodes take about 50 bytes per spectrum
+	std::size_t capacity_ = std::size_t{1} << 20;
+	std::uint64_t params_version_ = 0;
+
+	std::array<Shard, n_shards> shards_;
+
+	std::atomic<std::size_t> n_samples_{0};
+	std::atomic<std::size_t> n_no_data_{0};
+	std::atomic<std::size_t> n_hits_{0};
+	std::atomic<std::size_t> n_misses_{0};
+};
@@ -1,12 +1,32 @@
 #pragma once
+#include "../layer/output_layer.hpp"
+#include "../probability_raster.hpp"
+#include "../util/compaction.hpp"
+#include "classification_cache.hpp"
+#include "confusion_matrix.hpp"
+
 #include <esl/dense.hpp>
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cstddef>
+#include <exception>
+#include <mutex>
+#include <numeric>
+#include <stdexcept>
+#include <string>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
+struct Top_k_classification
+{
+	// Labels of each sample (column) in the order of decreasing probability
+	esl::Matrix_x<std::size_t> labels;
+	esl::Matrix_xd probabilities;
+};
+
 namespace internal
 {
 template<class Network>
@@ -19,53 +39,363 @@ public:
 	template<class In>
 	esl::Vector_x<std::size_t> operator()(const In& in) const
 	{
-		const auto n_workers = std::max(1u, std::thread::hardware_concurrency());
-		const auto n_samples = in.cols();
+		esl::Vector_x<std::size_t> labels(in.cols());
+		for_each_batch(in.cols(), [this, &in, &labels](std::size_t first, std::size_t n)
+		{
+			classify(in.cols_view(first, n), labels.rows_view(first, n));
+		});
+
+		return labels;
+	}
+
+	template<class In>
+	Top_k_classification operator()(const In& in, std::size_t k, double temperature) const
+	{
+		if (k == 0 || k > network_.output_size())
+			throw std::invalid_argument("Bad number of most probable labels " + std::to_string(k) + " of " +
+										std::to_string(network_.output_size()) + " classes");
+		if (!(temperature > 0))
+			throw std::invalid_argument("Softmax temperature should be positive");
+
+		Top_k_classification result;
+		result.labels.resize(k, in.cols());
+		result.probabilities.resize(k, in.cols());
+
+		for_each_batch(in.cols(), [this, &in, &result, temperature](std::size_t first, std::size_t n)
+		{
+			classify(in.cols_view(first, n), result.labels.cols_view(first, n),
+				result.probabilities.cols_view(first, n), temperature);
+		});
+
+		return result;
+	}
+
+	// Writes probabilities into the raster batch by batch, so that
+	// the full n_classes x n_samples matrix is never stored
+	template<class In>
+	esl::Vector_x<std::size_t> operator()(const In& in, const Probability_raster_writer& writer) const
+	{
+		esl::Vector_x<std::size_t> labels(in.cols());
+		for_each_batch(in.cols(), [this, &in, &labels, &writer](std::size_t first, std::size_t n)
+		{
+			classify(in.cols_view(first, n), labels.rows_view(first, n), writer, first);
+		});
+
+		return labels;
+	}
+
+	// Classifies only samples that are neither no-data samples
+	// nor have been seen before
+	template<class In>
+	esl::Vector_x<std::size_t> operator()(const In& in, Classification_cache& cache) const
+	{
+		esl::Vector_x<std::size_t> labels(in.cols());
+		for_each_batch(in.cols(), [this, &in, &labels, &cache](std::size_t first, std::size_t n)
+		{
+			classify(in.cols_view(first, n), labels.rows_view(first, n), cache);
+		});
+
+		return labels;
+	}
+
+	// Classifies only samples with non-zero mask values, compacted
+	// into dense batches; other samples get the no-data label
+	template<class In, class Mask>
+	esl::Vector_x<std::size_t> operator()(const In& in, const Mask& mask, std::size_t no_data_label) const
+	{
+		assert(mask.size() == in.cols());
+
+		esl::Vector_x<std::size_t> labels(in.cols());
+		for (std::size_t j = 0; j < labels.size(); ++j)
+			labels[j] = no_data_label;
+
+		// Valid samples are distributed evenly between workers
+		const auto indices = valid_indices(mask);
+		for_each_batch(indices.size(), [this, &in, &labels, &indices](std::size_t first, std::size_t n)
+		{
+			const auto batch_indices = indices.data() + first;
+			const auto batch = gather_cols(in, batch_indices, n);
+
+			esl::Vector_x<std::size_t> batch_labels(n);
+			classify(batch, batch_labels.rows_view(0, n));
+
+			for (std::size_t j = 0; j < n; ++j)
+				labels[batch_indices[j]] = batch_labels[j];
+		});
+
+		return labels;
+	}
+
+	// Each worker thread accumulates its own confusion matrix, labels
+	// of a batch are discarded as soon as they have been counted;
+	// samples with the ignored true label are not counted
+	template<class In, class Labels>
+	Confusion_matrix operator()(
+		const In& in, const Labels& true_labels, std::size_t n_classes, std::size_t ignored_label) const
+	{
+		assert(true_labels.size() == in.cols());
+
+		for (std::size_t j = 0; j < true_labels.size(); ++j)
+			if (true_labels[j] >= n_classes && true_labels[j] != ignored_label)
+				throw std::runtime_error("Bad true label " + std::to_string(true_labels[j]));
+
+		std::vector<Confusion_matrix> confusion_matrices(network_.n_threads(), Confusion_matrix(n_classes));
+		for_each_worker_batch(in.cols(), [&](std::size_t worker, std::size_t first, std::size_t n)
+		{
+			esl::Vector_x<std::size_t> labels(n);
+			classify(in.cols_view(first, n), labels.rows_view(0, n));
+
+			auto& confusion_matrix = confusion_matrices[worker];
+			for (std::size_t j = 0; j < n; ++j)
+				if (true_labels[first + j] != ignored_label)
+					confusion_matrix.add(true_labels[first + j], labels[j]);
+		});
+
+		for (std::size_t w = 1; w < confusion_matrices.size(); ++w)
+			confusion_matrices[0] += confusion_matrices[w];
+		return confusion_matrices[0];
+	}
+
+	// Classifies samples batch by batch in the calling thread
+	template<class In>
+	void classify_sequentially(const In& in, esl::Vector_x<std::size_t>& labels) const
+	{
+		labels.resize(in.cols());
+		for (std::size_t first = 0; first < in.cols(); first += network_.batch_size())
+		{
+			const auto n = std::min(in.cols() - first, network_.batch_size());
+			classify(in.cols_view(first, n), labels.rows_view(first, n));
+		}
+	}
+
+	// Classifies samples batch by batch in the calling thread
+	// and returns class probabilities of all samples
+	template<class In>
+	void classify_sequentially(
+		const In& in, esl::Vector_x<std::size_t>& labels, esl::Matrix_xd& probabilities) const
+	{
+		labels.resize(in.cols());
+		for (std::size_t first = 0; first < in.cols(); first += network_.batch_size())
+		{
+			const auto n = std::min(in.cols() - first, network_.batch_size());
+
+			typename Network::Layers_outputs outs;
+			network_.compute_logits(in.cols_view(first, n), outs);
+			auto& batch_probabilities = outs.back();
+			softmax_argmax(batch_probabilities, labels.rows_view(first, n));
+
+			if (first == 0)
+				probabilities.resize(batch_probabilities.rows(), in.cols());
+			probabilities.cols_view(first, n) = batch_probabilities;
+		}
+	}
+
+private:
+	// Splits samples into contiguous blocks, one per worker thread, and calls
+	// fn(first, n) for consecutive batches of each block, so that the size
+	// of layer outputs does not depend on the number of samples
+	template<class Fn>
+	void for_each_batch(std::size_t n_samples, Fn fn) const
+	{
+		for_each_worker_batch(n_samples, [&fn](std::size_t, std::size_t first, std::size_t n) { fn(first, n); });
+	}
+
+	// Calls fn(worker, first, n), worker indices are less than the number of threads;
+	// if fn throws (e.g., the raster cannot be written), other workers stop after
+	// their current batches, and the first exception is rethrown after they have finished
+	template<class Fn>
+	void for_each_worker_batch(std::size_t n_samples, Fn fn) const
+	{
+		const std::size_t n_workers = network_.n_threads();
 		const auto n_samples_per_worker = (n_samples + n_workers - 1) / n_workers;
+		const auto batch_size = network_.batch_size();
 
-		esl::Vector_x<std::size_t> labels(n_samples);
-		std::vector<std::thread> workers;
+		std::exception_ptr error;
+		std::mutex error_mutex;
+		std::atomic<bool> failed{false};
 
-		for (unsigned int i = 0; i < n_workers; ++i)
+		std::vector<std::thread> workers;
+		for (std::size_t first = 0; first < n_samples; first += n_samples_per_worker)
 		{
-			const auto first = i * n_samples_per_worker;
 			const auto n = std::min(n_samples - first, n_samples_per_worker);
-			workers.emplace_back(
-				[this, &in, &labels, first, n]() { classify(in.cols_view(first, n), labels.rows_view(first, n)); });
+			workers.emplace_back([&, worker = workers.size(), first, n, batch_size]()
+			{
+				try
+				{
+					for (std::size_t offset = 0; offset < n && !failed; offset += batch_size)
+						fn(worker, first + offset, std::min(n - offset, batch_size));
+				}
+				catch (...)
+				{
+					std::lock_guard lock(error_mutex);
+					if (!error)
+						error = std::current_exception();
+					failed = true;
+				}
+			});
 		}
 
 		for (auto& w : workers)
 			w.join();
 
-		return labels;
+		if (error)
+			std::rethrow_exception(error);
 	}
 
-private:
+	// Argmax of logits coincides with argmax of probabilities,
+	// so the softmax is not computed
 	template<class In, class Labels>
 	void classify(In in, Labels labels) const
 	{
 		const auto n = labels.size();
 		assert(in.cols() == n);
 
-		const auto outputs = network_.compute_outputs(in);
-		const auto& output = outputs.back();
-		assert(output.cols() == n);
+		typename Network::Layers_outputs outs;
+		network_.compute_logits(in, outs);
+		const auto& logits = outs.back();
+		assert(logits.cols() == n);
 
+		// Branch-free selection with the loop over samples being the innermost one
+		esl::Vector_xd max_values(n);
 		for (std::size_t j = 0; j < n; ++j)
 		{
+			max_values[j] = logits(0, j);
+			labels[j] = 0;
+		}
+
+		for (std::size_t i = 1; i < logits.rows(); ++i)
+			for (std::size_t j = 0; j < n; ++j)
+			{
+				const bool greater = logits(i, j) > max_values[j];
+				max_values[j] = greater ? logits(i, j) : max_values[j];
+				labels[j] = greater ? i : labels[j];
+			}
+	}
+
+	template<class In, class Labels, class Probabilities>
+	void classify(In in, Labels labels, Probabilities probabilities, double temperature) const
+	{
+		const auto k = labels.rows();
+		const auto n = labels.cols();
+		assert(in.cols() == n);
+
+		typename Network::Layers_outputs outs;
+		network_.compute_logits(in, outs);
+		auto& logits = outs.back();
+		assert(k <= logits.rows());
+
+		std::vector<std::size_t> indices(logits.rows());
+		for (std::size_t j = 0; j < n; ++j)
+		{
+			Output_layer::softmax(logits.col_view(j), temperature);
+
+			std::iota(indices.begin(), indices.end(), std::size_t{0});
+			std::partial_sort(indices.begin(), indices.begin() + k, indices.end(),
+				[&logits, j](std::size_t i1, std::size_t i2) { return logits(i1, j) > logits(i2, j); });
+
+			for (std::size_t i = 0; i < k; ++i)
+			{
+				labels(i, j) = indices[i];
+				probabilities(i, j) = logits(indices[i], j);
+			}
+		}
+	}
+
+	template<class In, class Labels>
+	void classify(In in, Labels labels, const Probability_raster_writer& writer, std::size_t first) const
+	{
+		const auto n = labels.size();
+		assert(in.cols() == n);
+
+		typename Network::Layers_outputs outs;
+		network_.compute_logits(in, outs);
+		auto& probabilities = outs.back();
+		assert(probabilities.rows() == writer.n_classes());
+
+		softmax_argmax(probabilities, labels);
+		writer.write(first, probabilities);
+	}
+
+	// Replaces logits with probabilities and finds the most probable labels
+	template<class Labels>
+	static void softmax_argmax(esl::Matrix_xd& logits, Labels labels)
+	{
+		assert(logits.cols() == labels.size());
+
+		for (std::size_t j = 0; j < logits.cols(); ++j)
+		{
+			Output_layer::softmax(logits.col_view(j));
+
 			std::size_t max_index = 0;
-			double max_value = 0;
-			for (std::size_t i = 0; i < output.rows(); ++i)
-				if (output(i, j) > max_value)
-				{
+			for (std::size_t i = 1; i < logits.rows(); ++i)
+				if (logits(i, j) > logits(max_index, j))
 					max_index = i;
-					max_value = output(i, j);
-				}
-
 			labels[j] = max_index;
 		}
 	}
 
+	template<class In, class Labels>
+	void classify(In in, Labels labels, Classification_cache& cache) const
+	{
+		const auto n = labels.size();
+		assert(in.cols() == n);
+
+		// Unique spectra that are not in the cache, and for each sample
+		// that needs classification the index of its unique spectrum
+		std::vector<std::size_t> unique_cols;
+		std::vector<Classification_cache::Key> unique_keys;
+		std::unordered_map<std::uint64_t, std::size_t> unique_index;
+		std::vector<std::pair<std::size_t, std::size_t>> pending;
+
+		std::size_t n_no_data = 0;
+		std::size_t n_hits = 0;
+		for (std::size_t j = 0; j < n; ++j)
+		{
+			const auto spectrum = in.col_view(j);
+			if (cache.is_no_data(spectrum))
+			{
+				labels[j] = cache.no_data_label();
+				++n_no_data;
+				continue;
+			}
+
+			const auto key = Classification_cache::key(spectrum);
+			std::size_t label;
+			if (cache.find(key, label))
+			{
+				labels[j] = label;
+				++n_hits;
+				continue;
+			}
+
+			const auto [it, inserted] = unique_index.try_emplace(key.hash, unique_cols.size());
+			if (!inserted && unique_keys[it->second].check == key.check)
+			{
+				pending.emplace_back(j, it->second);
+				++n_hits;
+				continue;
+			}
+
+			pending.emplace_back(j, unique_cols.size());
+			unique_cols.push_back(j);
+			unique_keys.push_back(key);
+		}
+
+		const auto n_unique = unique_cols.size();
+		cache.add_stats(n, n_no_data, n_hits, n_unique);
+		if (n_unique == 0)
+			return;
+
+		const auto batch = gather_cols(in, unique_cols);
+		esl::Vector_x<std::size_t> batch_labels(n_unique);
+		classify(batch, batch_labels.rows_view(0, n_unique));
+
+		for (std::size_t k = 0; k < n_unique; ++k)
+			cache.insert(unique_keys[k], batch_labels[k]);
+		for (auto [j, k] : pending)
+			labels[j] = batch_labels[k];
+	}
+
 private:
 	const Network& network_;
 };
@@ -0,0 +1,98 @@
+#pragma once
+#include "../util/socket.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// Connects processes into a ring and performs collective operations;
+// process with the given rank listens on endpoints[rank], connects
+// to the next one and accepts the connection from the previous one
+class Communicator
+{
+public:
+	Communicator(std::size_t rank, const std::vector<std::string>& endpoints,
+		std::chrono::seconds timeout = std::chrono::seconds{60}) :
+		rank_(rank),
+		size_(endpoints.size())
+	{
+		assert(rank_ < size_);
+		if (size_ == 1)
+			return;
+
+		const auto listener = Socket::listen(endpoints[rank_]);
+		next_ = Socket::connect(endpoints[(rank_ + 1) % size_], timeout);
+		prev_ = listener.accept();
+	}
+
+	std::size_t rank() const
+	{
+		return rank_;
+	}
+
+	std::size_t size() const
+	{
+		return size_;
+	}
+
+	// Ring all-reduce: the data is split into size() chunks, each chunk
+	// is first reduced while travelling around the ring (reduce-scatter)
+	// and then the reduced chunks are circulated (all-gather)
+	void all_reduce_sum(double* data, std::size_t n)
+	{
+		if (size_ == 1 || n == 0)
+			return;
+
+		const auto chunk_first = [this, n](std::size_t chunk) { return chunk * n / size_; };
+		const auto chunk_size = [&](std::size_t chunk) { return chunk_first(chunk + 1) - chunk_first(chunk); };
+
+		buffer_.resize(n / size_ + 1);
+		for (std::size_t step = 0; step + 1 < size_; ++step)
+		{
+			const auto send_chunk = (rank_ + size_ - step) % size_;
+			const auto recv_chunk = (rank_ + size_ - step - 1) % size_;
+
+			Socket::exchange(next_, data + chunk_first(send_chunk), chunk_size(send_chunk) * sizeof(double), prev_,
+				buffer_.data(), chunk_size(recv_chunk) * sizeof(double));
+
+			const auto recv_data = data + chunk_first(recv_chunk);
+			for (std::size_t i = 0; i < chunk_size(recv_chunk); ++i)
+				recv_data[i] += buffer_[i];
+		}
+
+		for (std::size_t step = 0; step + 1 < size_; ++step)
+		{
+			const auto send_chunk = (rank_ + 1 + size_ - step) % size_;
+			const auto recv_chunk = (rank_ + size_ - step) % size_;
+
+			Socket::exchange(next_, data + chunk_first(send_chunk), chunk_size(send_chunk) * sizeof(double), prev_,
+				data + chunk_first(recv_chunk), chunk_size(recv_chunk) * sizeof(double));
+		}
+	}
+
+	double all_reduce_sum(double value)
+	{
+		all_reduce_sum(&value, 1);
+		return value;
+	}
+
+	// Returns the range [first, first + n) of n_samples samples
+	// assigned to this process
+	std::pair<std::size_t, std::size_t> shard(std::size_t n_samples) const
+	{
+		const auto first = rank_ * n_samples / size_;
+		const auto last = (rank_ + 1) * n_samples / size_;
+		return {first, last - first};
+	}
+
+private:
+	const std::size_t rank_;
+	const std::size_t size_;
+
+	Socket next_;
+	Socket prev_;
+	std::vector<double> buffer_;
+};
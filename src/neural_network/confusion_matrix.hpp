@@ -0,0 +1,106 @@
+#pragma once
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <vector>
+
+// Confusion matrix of a classifier: element (i, j) is the number
+// of samples of the true class i that have been classified as j
+class Confusion_matrix
+{
+public:
+	// True label of samples that are not evaluated
+	static constexpr auto no_label = std::numeric_limits<std::size_t>::max();
+
+public:
+	explicit Confusion_matrix(std::size_t n_classes = 0) : n_classes_(n_classes), counts_(n_classes * n_classes, 0)
+	{}
+
+	std::size_t n_classes() const
+	{
+		return n_classes_;
+	}
+
+	std::size_t operator()(std::size_t true_label, std::size_t label) const
+	{
+		assert(true_label < n_classes_ && label < n_classes_);
+		return counts_[label + true_label * n_classes_];
+	}
+
+	void add(std::size_t true_label, std::size_t label)
+	{
+		assert(true_label < n_classes_ && label < n_classes_);
+		++counts_[label + true_label * n_classes_];
+	}
+
+	Confusion_matrix& operator+=(const Confusion_matrix& other)
+	{
+		assert(other.n_classes_ == n_classes_);
+		for (std::size_t i = 0; i < counts_.size(); ++i)
+			counts_[i] += other.counts_[i];
+		return *this;
+	}
+
+	std::size_t n_samples() const
+	{
+		std::size_t n = 0;
+		for (auto count : counts_)
+			n += count;
+		return n;
+	}
+
+	// Number of samples of the given true class
+	std::size_t n_samples(std::size_t true_label) const
+	{
+		std::size_t n = 0;
+		for (std::size_t j = 0; j < n_classes_; ++j)
+			n += (*this)(true_label, j);
+		return n;
+	}
+
+	std::size_t n_correct() const
+	{
+		std::size_t n = 0;
+		for (std::size_t i = 0; i < n_classes_; ++i)
+			n += (*this)(i, i);
+		return n;
+	}
+
+	// Fraction of correctly classified samples
+	double overall_accuracy() const
+	{
+		return static_cast<double>(n_correct()) / n_samples();
+	}
+
+	// Fraction of correctly classified samples of the given true class
+	// (producer's accuracy), NaN if there are no such samples
+	double class_accuracy(std::size_t true_label) const
+	{
+		const auto n = n_samples(true_label);
+		return n > 0 ? static_cast<double>((*this)(true_label, true_label)) / n
+					 : std::numeric_limits<double>::quiet_NaN();
+	}
+
+	// Cohen's kappa, the agreement between true and predicted labels
+	// corrected for the agreement expected by chance
+	double kappa() const
+	{
+		const auto n = static_cast<double>(n_samples());
+
+		double chance_agreement = 0;
+		for (std::size_t i = 0; i < n_classes_; ++i)
+		{
+			std::size_t n_predicted = 0;
+			for (std::size_t j = 0; j < n_classes_; ++j)
+				n_predicted += (*this)(j, i);
+			chance_agreement += static_cast<double>(n_samples(i)) * n_predicted / (n * n);
+		}
+
+		return (overall_accuracy() - chance_agreement) / (1 - chance_agreement);
+	}
+
+private:
+	std::size_t n_classes_;
+	std::vector<std::size_t> counts_;
+};
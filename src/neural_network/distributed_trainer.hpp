@@ -0,0 +1,275 @@
+#pragma once
+#include "../layer/parameters.hpp"
+#include "communicator.hpp"
+#include "trainer.hpp"
+
+#include <esl/dense.hpp>
+#include <esu/thread.hpp>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+namespace internal
+{
+// Data-parallel trainer: inside a process gradients are computed by several
+// threads as in Trainer, between processes they are summed by the communicator;
+// gradients of a layer are reduced in a separate thread as soon as all workers
+// have computed them, while the workers continue the backward pass through
+// preceding layers
+template<class Network>
+class Distributed_trainer
+{
+private:
+	using Layers_parameters = typename Network::Layers_parameters;
+	static constexpr auto n_layers = Network::n_layers;
+
+public:
+	Distributed_trainer(Network& network, Communicator& comm) : network_(network), comm_(comm)
+	{}
+
+	template<class In, class Labels, class Callback_fn>
+	esl::Vector_xd operator()(
+		const In& in, const Labels& labels, unsigned int n_iters, double rate, Callback_fn callback_fn)
+	{
+		assert(in.cols() == labels.size());
+
+		// All processes must agree to throw, otherwise the others would wait forever
+		// in the collective operations below
+		const auto n_empty_shards = static_cast<std::size_t>(comm_.all_reduce_sum(labels.size() == 0 ? 1. : 0.));
+		if (n_empty_shards > 0)
+			throw std::runtime_error("Training set is empty in " + std::to_string(n_empty_shards) + " process(es)");
+
+		broadcast_parameters();
+
+		const auto n_samples = comm_.all_reduce_sum(static_cast<double>(labels.size()));
+		const auto n_local_samples = labels.size();
+		const std::size_t n_threads = network_.n_threads();
+		const auto n_samples_per_worker = (n_local_samples + n_threads - 1) / n_threads;
+
+		// No worker gets an empty set of samples
+		const auto n_workers = (n_local_samples + n_samples_per_worker - 1) / n_samples_per_worker;
+
+		std::vector<std::thread> workers;
+
+		std::vector<Layers_parameters> wrk_param_grads(n_workers);
+		esl::Vector_xd wrk_loss_function(n_workers);
+		esl::Vector_xd loss_function(n_iters);
+
+		// Number of workers that have computed gradients of each layer
+		std::array<std::atomic<std::size_t>, n_layers> n_done_workers{};
+
+		std::mutex mutex;
+		std::condition_variable cond_var;
+		std::array<bool, n_layers> is_ready{};
+		std::size_t n_reduced_layers = 0;
+
+		const auto n_trainable_layers = count_trainable_layers();
+
+		// Communication errors (e.g., a lost peer) in the reducer thread or in the barrier
+		// completion stop the training; workers leave the loop after the barrier, and
+		// the first exception is rethrown after all threads have finished
+		std::exception_ptr error;
+		std::atomic<bool> failed{false};
+		const auto abort = [&]()
+		{
+			std::lock_guard lock{mutex};
+			if (!error)
+				error = std::current_exception();
+			failed = true;
+			cond_var.notify_all();
+		};
+
+		// Sums gradients of all workers into wrk_param_grads[0] and passes them to the reducer thread
+		const auto on_layer_done = [&](auto index)
+		{
+			constexpr auto i = decltype(index)::value;
+			if (n_done_workers[i].fetch_add(1) + 1 < n_workers)
+				return;
+
+			n_done_workers[i] = 0;
+			auto& grads = std::get<i>(wrk_param_grads[0]);
+			for (std::size_t w = 1; w < n_workers; ++w)
+			{
+				grads.weights += std::get<i>(wrk_param_grads[w]).weights;
+				grads.biases += std::get<i>(wrk_param_grads[w]).biases;
+			}
+
+			std::lock_guard lock{mutex};
+			is_ready[i] = true;
+			cond_var.notify_all();
+		};
+
+		// Layers are reduced in the order of the backward pass,
+		// which is the same in all processes
+		std::thread reducer([&, this]()
+		{
+			try
+			{
+				for (unsigned int it = 0; it < n_iters && !failed; ++it)
+					for_each_trainable_layer([&, this](auto index)
+					{
+						constexpr auto i = decltype(index)::value;
+						{
+							std::unique_lock lock{mutex};
+							cond_var.wait(lock, [&] { return failed || is_ready[i]; });
+							if (failed)
+								return;
+							is_ready[i] = false;
+						}
+
+						all_reduce(std::get<i>(wrk_param_grads[0]));
+
+						std::lock_guard lock{mutex};
+						++n_reduced_layers;
+						cond_var.notify_all();
+					});
+			}
+			catch (...)
+			{
+				abort();
+			}
+		});
+
+		esu::Barrier barrier(n_workers, [&, this](std::size_t it)
+		{
+			try
+			{
+				{
+					std::unique_lock lock{mutex};
+					cond_var.wait(lock, [&] { return failed || n_reduced_layers == n_trainable_layers; });
+					if (failed)
+						return;
+					n_reduced_layers = 0;
+				}
+
+				network_.add_gradients(-rate / n_samples, wrk_param_grads[0]);
+
+				double local_loss_function = 0;
+				for (std::size_t i = 0; i < wrk_loss_function.size(); ++i)
+					local_loss_function += wrk_loss_function[i];
+				loss_function[it] = comm_.all_reduce_sum(local_loss_function) / n_samples;
+
+				callback_fn(it, loss_function[it]);
+			}
+			catch (...)
+			{
+				abort();
+			}
+		});
+
+		for (std::size_t i = 0; i < n_workers; ++i)
+		{
+			const auto first = i * n_samples_per_worker;
+			const auto n = std::min(n_local_samples - first, n_samples_per_worker);
+
+			workers.emplace_back([&, n, first, i, this]()
+			{
+				with_worker_input(in.cols_view(first, n), i, network_.pin_threads_, [&](const auto& wrk_in)
+				{
+					train_step(wrk_in, labels.rows_view(first, n), wrk_param_grads[i], wrk_loss_function[i], barrier,
+						failed, n_iters, on_layer_done);
+				});
+			});
+		}
+
+		for (auto& w : workers)
+			w.join();
+		reducer.join();
+
+		if (error)
+			std::rethrow_exception(error);
+
+		return loss_function;
+	}
+
+private:
+	template<class In, class Labels, class Barrier, class Layer_done_fn>
+	void train_step(const In& in, Labels labels, Layers_parameters& param_grads, double& loss_function, Barrier& barrier,
+		const std::atomic<bool>& failed, unsigned int n_iters, const Layer_done_fn& on_layer_done)
+	{
+		assert(in.cols() == labels.size());
+
+		typename Network::Layers_outputs outs;
+		typename Network::Layers_caches caches;
+		typename Network::Layers_outputs out_grads;
+
+		for (unsigned int it = 0; it < n_iters; ++it)
+		{
+			loss_function =
+				network_.compute_loss_and_gradients(in, labels, outs, caches, out_grads, param_grads, on_layer_done);
+
+			barrier.wait();
+			if (failed)
+				break;
+		}
+	}
+
+	// Replaces parameters in all processes with those of the process with rank 0
+	void broadcast_parameters()
+	{
+		for_each_trainable_layer([this](auto index)
+		{
+			auto& layer = std::get<decltype(index)::value>(network_.layers_);
+
+			auto params = layer.params();
+			if (comm_.rank() != 0)
+				params.reset();
+
+			all_reduce(params);
+			layer.set_params(params);
+		});
+	}
+
+	// Weights and biases are packed into a single message
+	void all_reduce(Trainable_parameters& params)
+	{
+		const auto n_weights = params.weights.size();
+		const auto n_biases = params.biases.size();
+
+		buffer_.resize(n_weights + n_biases);
+		std::copy_n(params.weights.data(), n_weights, buffer_.data());
+		std::copy_n(params.biases.data(), n_biases, buffer_.data() + n_weights);
+
+		comm_.all_reduce_sum(buffer_.data(), buffer_.size());
+
+		std::copy_n(buffer_.data(), n_weights, params.weights.data());
+		std::copy_n(buffer_.data() + n_weights, n_biases, params.biases.data());
+	}
+
+	// Calls fn(std::integral_constant<std::size_t, index>{}) for trainable
+	// layers in the reverse order
+	template<std::size_t index = n_layers - 1, class Fn>
+	static void for_each_trainable_layer(Fn fn)
+	{
+		if constexpr (!std::is_same_v<std::tuple_element_t<index, Layers_parameters>, Empty_parameters>)
+			fn(std::integral_constant<std::size_t, index>{});
+
+		if constexpr (index > 0)
+			for_each_trainable_layer<index - 1>(fn);
+	}
+
+	static std::size_t count_trainable_layers()
+	{
+		std::size_t n = 0;
+		for_each_trainable_layer([&n](auto) { ++n; });
+		return n;
+	}
+
+private:
+	Network& network_;
+	Communicator& comm_;
+	std::vector<double> buffer_;
+};
+} // namespace internal
@@ -0,0 +1,297 @@
+#pragma once
+#include "../layer/output_layer.hpp"
+#include "../probability_raster.hpp"
+#include "scene_classifier.hpp"
+
+#include <esl/dense.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+enum class Ensemble_rule
+{
+	// Class probabilities are averaged over models
+	mean,
+	// Each model votes for its most probable class,
+	// "probabilities" are fractions of votes
+	vote
+};
+
+// Classifies samples with several networks (e.g., trained with different seeds)
+// and combines their class probabilities; all networks are run over a batch
+// of samples while it is in cache, threads process different batches, and
+// models are split between threads only if there are too few batches
+template<class Network>
+class Ensemble_classifier
+{
+public:
+	Ensemble_classifier(std::vector<Network> networks, Ensemble_rule rule = Ensemble_rule::mean) :
+		networks_(std::move(networks)), rule_(rule)
+	{
+		assert(!networks_.empty());
+		for ([[maybe_unused]] const auto& network : networks_)
+			assert(network.input_size() == input_size() && network.output_size() == output_size());
+	}
+
+	// Sets the number of threads, zero means the number of hardware threads
+	void set_n_threads(unsigned int n_threads)
+	{
+		n_threads_ = n_threads;
+	}
+
+	unsigned int n_threads() const
+	{
+		return n_threads_ > 0 ? n_threads_ : std::max(1u, std::thread::hardware_concurrency());
+	}
+
+	void set_batch_size(std::size_t batch_size)
+	{
+		assert(batch_size > 0);
+		batch_size_ = batch_size;
+	}
+
+	std::size_t n_models() const
+	{
+		return networks_.size();
+	}
+
+	std::size_t input_size() const
+	{
+		return networks_.front().input_size();
+	}
+
+	// Number of classes
+	std::size_t output_size() const
+	{
+		return networks_.front().output_size();
+	}
+
+	template<class In>
+	esl::Vector_x<std::size_t> classify(const In& in) const
+	{
+		assert(in.rows() == input_size());
+
+		esl::Vector_x<std::size_t> labels(in.cols());
+		for_each_batch(in, [&labels](std::size_t first, const esl::Matrix_xd& probabilities)
+		{
+			argmax(probabilities, labels.rows_view(first, probabilities.cols()));
+		});
+
+		return labels;
+	}
+
+	// Returns labels and writes combined probabilities
+	// and confidences of all samples into the raster
+	template<class In>
+	esl::Vector_x<std::size_t> classify(const In& in, const Probability_raster_writer& writer) const
+	{
+		assert(in.rows() == input_size());
+		assert(writer.n_classes() == output_size());
+
+		esl::Vector_x<std::size_t> labels(in.cols());
+		for_each_batch(in, [&labels, &writer](std::size_t first, const esl::Matrix_xd& probabilities)
+		{
+			argmax(probabilities, labels.rows_view(first, probabilities.cols()));
+			writer.write(first, probabilities);
+		});
+
+		return labels;
+	}
+
+	// Classifies the image read tile by tile, see Neural_network::classify_tiles()
+	template<class Tile_reader, class Write_fn>
+	void classify_tiles(Tile_reader& reader, Write_fn write, bool with_probabilities = false) const
+	{
+		assert(reader.spectrum_size() == input_size());
+		internal::Scene_classifier{*this, n_threads()}(reader, write, with_probabilities);
+	}
+
+	// Classifies samples batch by batch in the calling thread
+	template<class In>
+	void classify_sequentially(const In& in, esl::Vector_x<std::size_t>& labels) const
+	{
+		labels.resize(in.cols());
+		for (std::size_t first = 0; first < in.cols(); first += batch_size_)
+		{
+			const auto n = std::min(in.cols() - first, batch_size_);
+			argmax(combine(in.cols_view(first, n)), labels.rows_view(first, n));
+		}
+	}
+
+	// Classifies samples batch by batch in the calling thread
+	// and returns combined probabilities of all samples
+	template<class In>
+	void classify_sequentially(
+		const In& in, esl::Vector_x<std::size_t>& labels, esl::Matrix_xd& probabilities) const
+	{
+		labels.resize(in.cols());
+		probabilities.resize(output_size(), in.cols());
+		for (std::size_t first = 0; first < in.cols(); first += batch_size_)
+		{
+			const auto n = std::min(in.cols() - first, batch_size_);
+			const auto batch_probabilities = combine(in.cols_view(first, n));
+
+			argmax(batch_probabilities, labels.rows_view(first, n));
+			probabilities.cols_view(first, n) = batch_probabilities;
+		}
+	}
+
+private:
+	// Work items are (batch, group of models) pairs; the thread that completes
+	// the last item of a batch calls fn(first, probabilities) for it
+	template<class In, class Fn>
+	void for_each_batch(const In& in, Fn fn) const
+	{
+		const auto n_samples = in.cols();
+		const auto n_models = networks_.size();
+		const std::size_t n_threads = this->n_threads();
+
+		const auto n_batches = (n_samples + batch_size_ - 1) / batch_size_;
+		if (n_batches == 0)
+			return;
+
+		const auto n_groups_wanted = std::clamp<std::size_t>((n_threads + n_batches - 1) / n_batches, 1, n_models);
+		const auto n_models_per_group = (n_models + n_groups_wanted - 1) / n_groups_wanted;
+		const auto n_groups = (n_models + n_models_per_group - 1) / n_models_per_group;
+		const auto n_items = n_batches * n_groups;
+
+		// Partial sums of groups are combined by the thread that completes the batch
+		std::vector<esl::Matrix_xd> group_sums(n_items);
+		std::vector<std::atomic<std::size_t>> n_done_groups(n_batches);
+		std::atomic<std::size_t> next_item{0};
+
+		// After the first exception no new items are taken,
+		// and it is rethrown after all threads have finished
+		std::exception_ptr error;
+		std::mutex error_mutex;
+
+		const auto run = [&]()
+		{
+			try
+			{
+				for (auto item = next_item++; item < n_items; item = next_item++)
+				{
+					const auto batch = item / n_groups;
+					const auto group = item % n_groups;
+
+					const auto first = batch * batch_size_;
+					const auto n = std::min(n_samples - first, batch_size_);
+					const auto first_model = group * n_models_per_group;
+					const auto n_group_models = std::min(n_models - first_model, n_models_per_group);
+
+					group_sums[item] = sum_scores(in.cols_view(first, n), first_model, n_group_models);
+					if (++n_done_groups[batch] < n_groups)
+						continue;
+
+					auto& probabilities = group_sums[batch * n_groups];
+					for (std::size_t g = 1; g < n_groups; ++g)
+					{
+						probabilities += group_sums[batch * n_groups + g];
+						group_sums[batch * n_groups + g] = esl::Matrix_xd{};
+					}
+
+					normalize(probabilities, n_models);
+					fn(first, static_cast<const esl::Matrix_xd&>(probabilities));
+					probabilities = esl::Matrix_xd{};
+				}
+			}
+			catch (...)
+			{
+				std::lock_guard lock(error_mutex);
+				if (!error)
+					error = std::current_exception();
+				next_item = n_items;
+			}
+		};
+
+		std::vector<std::thread> workers;
+		for (std::size_t i = 1; i < std::min<std::size_t>(n_threads, n_items); ++i)
+			workers.emplace_back(run);
+		run();
+
+		for (auto& w : workers)
+			w.join();
+
+		if (error)
+			std::rethrow_exception(error);
+	}
+
+	// Returns combined probabilities of all models
+	template<class In>
+	esl::Matrix_xd combine(const In& in) const
+	{
+		auto probabilities = sum_scores(in, 0, networks_.size());
+		normalize(probabilities, networks_.size());
+		return probabilities;
+	}
+
+	// Returns the sum of probabilities or of votes of the given models
+	template<class In>
+	esl::Matrix_xd sum_scores(const In& in, std::size_t first_model, std::size_t n_models) const
+	{
+		const auto n = in.cols();
+
+		esl::Matrix_xd sum(output_size(), n);
+		sum = 0;
+
+		typename Network::Layers_outputs outs;
+		for (auto m = first_model; m < first_model + n_models; ++m)
+		{
+			networks_[m].compute_logits(in, outs);
+			auto& logits = outs.back();
+
+			if (rule_ == Ensemble_rule::mean)
+			{
+				for (std::size_t j = 0; j < n; ++j)
+					Output_layer::softmax(logits.col_view(j));
+				sum += logits;
+			}
+			else
+			{
+				// Argmax of logits coincides with argmax of probabilities
+				esl::Vector_x<std::size_t> labels(n);
+				argmax(logits, labels.rows_view(0, n));
+				for (std::size_t j = 0; j < n; ++j)
+					sum(labels[j], j) += 1;
+			}
+		}
+
+		return sum;
+	}
+
+	static void normalize(esl::Matrix_xd& sum, std::size_t n_models)
+	{
+		for (std::size_t j = 0; j < sum.cols(); ++j)
+			for (std::size_t i = 0; i < sum.rows(); ++i)
+				sum(i, j) /= n_models;
+	}
+
+	// The first maximum is taken, so ties are broken in favour of smaller labels
+	template<class Scores, class Labels>
+	static void argmax(const Scores& scores, Labels labels)
+	{
+		assert(scores.cols() == labels.size());
+
+		for (std::size_t j = 0; j < scores.cols(); ++j)
+		{
+			std::size_t max_index = 0;
+			for (std::size_t i = 1; i < scores.rows(); ++i)
+				if (scores(i, j) > scores(max_index, j))
+					max_index = i;
+			labels[j] = max_index;
+		}
+	}
+
+private:
+	const std::vector<Network> networks_;
+	const Ensemble_rule rule_;
+	unsigned int n_threads_ = 0;
+	std::size_t batch_size_ = 1024;
+};
@@ -0,0 +1,244 @@
+#pragma once
+#include "../layer/layer.hpp"
+#include "../layer/parameters.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <iterator>
+#include <numeric>
+#include <random>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+struct Layer_gradient_check
+{
+	std::size_t layer_index;
+	std::string layer_name;
+	std::size_t n_checked_params;
+	// Parameters whose perturbation in both directions moves maximums in pooling
+	// layers, so that the loss function is not differentiable near them
+	std::size_t n_skipped_params;
+	double max_relative_error;
+	// Whether the maximum relative error does not exceed the tolerance
+	bool is_passed;
+};
+
+namespace internal
+{
+// Compares analytical gradients of randomly sampled parameters with their
+// central finite-difference estimates; parameters are distributed between
+// threads, each of them perturbs parameters of its own copy of the network
+template<class Network>
+class Gradient_checker
+{
+private:
+	static constexpr auto n_layers = Network::n_layers;
+
+	struct Sample
+	{
+		std::size_t layer_index;
+		std::size_t param_index;
+		double analytical_grad;
+		double relative_error;
+		bool is_skipped;
+	};
+
+public:
+	Gradient_checker(const Network& network) : network_(network)
+	{}
+
+	// The input should be already transformed
+	template<class In, class Labels>
+	std::vector<Layer_gradient_check> operator()(
+		const In& in, const Labels& labels, std::size_t n_params_per_layer, double tolerance, double delta) const
+	{
+		typename Network::Layers_outputs outs;
+		typename Network::Layers_caches caches;
+		typename Network::Layers_outputs out_grads;
+		typename Network::Layers_parameters param_grads;
+		network_.compute_outputs(in, outs, caches);
+		network_.compute_gradients(in, outs, caches, labels, out_grads, param_grads);
+		const auto loss = network_.compute_loss(outs, labels);
+
+		auto samples = sample_params(param_grads, n_params_per_layer);
+
+		const std::size_t n_workers = std::min<std::size_t>(network_.n_threads(), samples.size());
+		std::vector<std::thread> workers;
+		for (std::size_t w = 0; w < n_workers; ++w)
+			workers.emplace_back([&, w, this]()
+			{
+				auto network = network_;
+				for (std::size_t i = w; i < samples.size(); i += n_workers)
+					check(network, in, labels, caches, loss, samples[i], delta);
+			});
+
+		for (auto& w : workers)
+			w.join();
+
+		std::vector<Layer_gradient_check> checks;
+		for (const auto& sample : samples)
+		{
+			if (checks.empty() || checks.back().layer_index != sample.layer_index)
+				checks.push_back({sample.layer_index, layer_name(sample.layer_index), 0, 0, 0, false});
+
+			auto& check = checks.back();
+			if (sample.is_skipped)
+				++check.n_skipped_params;
+			else
+			{
+				++check.n_checked_params;
+				check.max_relative_error = std::max(check.max_relative_error, sample.relative_error);
+			}
+		}
+
+		for (auto& check : checks)
+			check.is_passed = check.max_relative_error <= tolerance;
+
+		return checks;
+	}
+
+private:
+	// Samples (at most) n_params_per_layer weights and as many biases of each
+	// trainable layer, biases are sampled separately as they are much fewer
+	std::vector<Sample> sample_params(
+		const typename Network::Layers_parameters& param_grads, std::size_t n_params_per_layer) const
+	{
+		std::vector<Sample> samples;
+		std::mt19937 generator{0};
+
+		for_each_trainable_layer([&](auto index)
+		{
+			constexpr auto i = decltype(index)::value;
+			const auto& layer = std::get<i>(network_.layers_);
+
+			std::vector<std::size_t> all_indices(layer.n_trainable_params());
+			std::iota(all_indices.begin(), all_indices.end(), std::size_t{0});
+			const auto biases_first = all_indices.begin() + layer.params().weights.size();
+
+			std::vector<std::size_t> indices;
+			std::sample(all_indices.begin(), biases_first, std::back_inserter(indices), n_params_per_layer, generator);
+			std::sample(biases_first, all_indices.end(), std::back_inserter(indices), n_params_per_layer, generator);
+
+			for (auto param_index : indices)
+				samples.push_back({i, param_index, layer.param(std::get<i>(param_grads), param_index), 0, false});
+		});
+
+		return samples;
+	}
+
+	// If the perturbation in one direction moves maximums in pooling layers,
+	// the one-sided difference in the other direction is used instead
+	template<class In, class Labels>
+	static void check(Network& network, const In& in, const Labels& labels,
+		const typename Network::Layers_caches& caches, double loss, Sample& sample, double delta)
+	{
+		typename Network::Layers_outputs outs;
+		typename Network::Layers_caches perturbed_caches;
+
+		// Returns the loss function and whether maximums have stayed in place
+		const auto loss_fn = [&]()
+		{
+			network.compute_outputs(in, outs, perturbed_caches);
+			return std::pair{network.compute_loss(outs, labels), same_caches(caches, perturbed_caches)};
+		};
+
+		for_each_trainable_layer([&](auto index)
+		{
+			constexpr auto i = decltype(index)::value;
+			if (sample.layer_index != i)
+				return;
+
+			auto& layer = std::get<i>(network.layers_);
+
+			layer.perturb_param(sample.param_index, delta);
+			const auto [loss_plus, is_smooth_plus] = loss_fn();
+			layer.perturb_param(sample.param_index, -2 * delta);
+			const auto [loss_minus, is_smooth_minus] = loss_fn();
+			layer.perturb_param(sample.param_index, delta);
+
+			double fd_grad;
+			if (is_smooth_plus && is_smooth_minus)
+				fd_grad = (loss_plus - loss_minus) / (2 * delta);
+			else if (is_smooth_plus || is_smooth_minus)
+			{
+				// Second-order one-sided difference
+				const auto step = is_smooth_plus ? delta : -delta;
+				layer.perturb_param(sample.param_index, 2 * step);
+				const auto [loss_2, is_smooth_2] = loss_fn();
+				layer.perturb_param(sample.param_index, -2 * step);
+
+				sample.is_skipped = !is_smooth_2;
+				const auto loss_1 = is_smooth_plus ? loss_plus : loss_minus;
+				fd_grad = (4 * loss_1 - 3 * loss - loss_2) / (2 * step);
+			}
+			else
+				sample.is_skipped = true;
+
+			if (sample.is_skipped)
+				return;
+
+			// Gradients close to zero are compared in absolute terms
+			const auto an_grad = sample.analytical_grad;
+			sample.relative_error =
+				std::abs(fd_grad - an_grad) / std::max(std::abs(fd_grad) + std::abs(an_grad), min_grad_scale);
+		});
+	}
+
+	template<std::size_t index = 0>
+	static bool same_caches(const typename Network::Layers_caches& caches1,
+		const typename Network::Layers_caches& caches2)
+	{
+		using Cache = std::tuple_element_t<index, typename Network::Layers_caches>;
+		if constexpr (!std::is_same_v<Cache, Empty_cache>)
+		{
+			const auto& c1 = std::get<index>(caches1);
+			const auto& c2 = std::get<index>(caches2);
+			if (c1.rows() != c2.rows() || c1.cols() != c2.cols())
+				return false;
+
+			for (std::size_t col = 0; col < c1.cols(); ++col)
+				for (std::size_t row = 0; row < c1.rows(); ++row)
+					if (c1(row, col) != c2(row, col))
+						return false;
+		}
+
+		if constexpr (index + 1 < n_layers)
+			return same_caches<index + 1>(caches1, caches2);
+		else
+			return true;
+	}
+
+	std::string layer_name(std::size_t layer_index) const
+	{
+		std::string name;
+		for_each_trainable_layer([this, layer_index, &name](auto index)
+		{
+			if (decltype(index)::value == layer_index)
+				name = std::get<decltype(index)::value>(network_.layers_).name();
+		});
+		return name;
+	}
+
+	// Calls fn(std::integral_constant<std::size_t, index>{}) for trainable layers
+	template<std::size_t index = 0, class Fn>
+	static void for_each_trainable_layer(Fn fn)
+	{
+		using Parameters = std::tuple_element_t<index, typename Network::Layers_parameters>;
+		if constexpr (!std::is_same_v<Parameters, Empty_parameters>)
+			fn(std::integral_constant<std::size_t, index>{});
+
+		if constexpr (index + 1 < n_layers)
+			for_each_trainable_layer<index + 1>(fn);
+	}
+
+private:
+	static constexpr double min_grad_scale = 1e-6;
+
+	const Network& network_;
+};
+} // namespace internal
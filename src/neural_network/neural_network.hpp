@@ -1,7 +1,15 @@
 #pragma once
+#include "../layer/layer.hpp"
 #include "../layer/parameters.hpp"
-#include "../util/loss_fn_calculator.hpp"
+#include "../pca_transform.hpp"
+#include "../util/compaction.hpp"
+#include "async_trainer.hpp"
 #include "classifier.hpp"
+#include "communicator.hpp"
+#include "const_init.hpp"
+#include "distributed_trainer.hpp"
+#include "gradient_checker.hpp"
+#include "scene_classifier.hpp"
 #include "trainer.hpp"
 
 #include <esl/dense.hpp>
@@ -10,21 +18,39 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <cassert>
 #include <cmath>
 #include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <optional>
+#include <ostream>
+#include <stdexcept>
 #include <string>
+#include <thread>
 #include <tuple>
 #include <type_traits>
 #include <utility>
 #include <vector>
 
-#include <iostream>
+namespace internal
+{
+// Returns a version of network parameters that is unique among all networks
+inline std::uint64_t next_params_version()
+{
+	static std::atomic<std::uint64_t> version{0};
+	return ++version;
+}
+} // namespace internal
 
 template<class... Layers>
 class Neural_network
 {
 	friend class internal::Trainer<Neural_network>;
+	friend class internal::Async_trainer<Neural_network>;
+	friend class internal::Gradient_checker<Neural_network>;
+	friend class internal::Distributed_trainer<Neural_network>;
 
 public:
 	static constexpr auto n_layers = sizeof...(Layers);
@@ -32,6 +58,7 @@ public:
 
 	using Layers_outputs = std::array<esl::Matrix_xd, n_layers>;
 	using Layers_parameters = std::tuple<typename Layers::Parameters...>;
+	using Layers_caches = std::tuple<typename Layers::Cache...>;
 
 private:
 	using Layers_tuple = std::tuple<Layers...>;
@@ -63,20 +90,103 @@ public:
 		Neural_network(std::make_index_sequence<n_layers>{}, std::forward_as_tuple(std::forward<Ts>(arg_tuples)...))
 	{}
 
+	// Sets the transform that is applied to the input data before the first
+	// layer; should be called before init(), input_size is the size of raw data
+	void set_input_transform(Pca_transform transform)
+	{
+		input_transform_ = std::move(transform);
+		params_version_ = internal::next_params_version();
+	}
+
+	// Pins training threads to CPUs; each pinned thread keeps its part
+	// of the training set and its scratch storage on its own NUMA node
+	void set_pin_threads(bool pin_threads)
+	{
+		pin_threads_ = pin_threads;
+	}
+
+	// Sets the number of threads used for training and classification,
+	// zero means the number of hardware threads
+	void set_n_threads(unsigned int n_threads)
+	{
+		n_threads_ = n_threads;
+	}
+
+	unsigned int n_threads() const
+	{
+		return n_threads_ > 0 ? n_threads_ : std::max(1u, std::thread::hardware_concurrency());
+	}
+
+	// Sets the maximum number of samples each classification
+	// thread passes through the network at once
+	void set_batch_size(std::size_t batch_size)
+	{
+		assert(batch_size > 0);
+		batch_size_ = batch_size;
+	}
+
+	std::size_t batch_size() const
+	{
+		return batch_size_;
+	}
+
+	// Sets the maximum number of samples each training thread passes through the network
+	// at once; gradients are summed over chunks of samples, so layer outputs and their
+	// gradients are stored for a single chunk and their memory does not grow with the size
+	// of the training set; zero means that all samples of the thread are passed at once
+	void set_train_chunk_size(std::size_t train_chunk_size)
+	{
+		train_chunk_size_ = train_chunk_size;
+	}
+
+	std::size_t train_chunk_size() const
+	{
+		return train_chunk_size_;
+	}
+
 	template<class Strategy>
-	void init(Strategy&& init_strategy, std::size_t input_size)
+	void init(Strategy&& init_strategy, std::size_t input_size,
+		Activation_layout layout = Activation_layout::feature_major)
 	{
+		assert(!input_transform_ || input_transform_->input_size() == input_size);
+
 		input_size_ = input_size;
+		esu::tuple_for_each([layout](auto& layer) { layer.set_layout(layout); }, layers_);
 
-		std::get<0>(layers_).init(init_strategy, Input_layer{input_size});
+		const auto first_layer_input_size = input_transform_ ? input_transform_->output_size() : input_size;
+		std::get<0>(layers_).init(init_strategy, Input_layer{first_layer_input_size});
 		init_impl(init_strategy, std::make_index_sequence<n_layers - 1>{});
+		params_version_ = internal::next_params_version();
+	}
+
+	// Changes whenever parameters change (the network is initialized, loaded,
+	// trained or pruned); copies of the network share the version until then
+	std::uint64_t params_version() const
+	{
+		return params_version_;
+	}
+
+	// Size of raw input data
+	std::size_t input_size() const
+	{
+		return input_size_;
+	}
+
+	// Number of classes
+	std::size_t output_size() const
+	{
+		return std::get<n_layers - 1>(layers_).output_size();
 	}
 
+	// Inference forward pass, the input transform is applied
 	template<class In>
 	void compute_outputs(const In& in, Layers_outputs& outs) const
 	{
-		std::get<0>(layers_).compute_output(in, outs[0]);
-		compute_outputs_impl(outs, std::make_index_sequence<n_layers - 1>{});
+		with_transformed_input(in, [this, &outs](const auto& tr_in)
+		{
+			std::get<0>(layers_).compute_output(tr_in, outs[0]);
+			compute_outputs_impl(outs, std::make_index_sequence<n_layers - 1>{});
+		});
 	}
 
 	template<class In>
@@ -87,11 +197,54 @@ public:
 		return outs;
 	}
 
+	// Inference forward pass that stops at the output layer logits,
+	// the input transform is applied
 	template<class In>
-	void compute_gradients(
-		const In& in, const Layers_outputs& outs, Layers_outputs& out_grads, Layers_parameters& param_grads) const
+	void compute_logits(const In& in, Layers_outputs& outs) const
 	{
-		compute_gradients_impl(in, outs, out_grads, param_grads);
+		with_transformed_input(in, [this, &outs](const auto& tr_in)
+		{
+			std::get<0>(layers_).compute_output(tr_in, outs[0]);
+			compute_outputs_impl(outs, std::make_index_sequence<n_layers - 2>{});
+			std::get<n_layers - 1>(layers_).compute_logits(outs[n_layers - 2], outs[n_layers - 1]);
+		});
+	}
+
+	// Training forward pass that also fills layer caches required by the backward
+	// pass; the input transform is not applied, the input should be already transformed;
+	// the output layer computes logits, which the loss function and its gradient use
+	template<class In>
+	void compute_outputs(const In& in, Layers_outputs& outs, Layers_caches& caches) const
+	{
+		compute_output<0>(in, outs[0], caches);
+		compute_outputs_impl(outs, caches, std::make_index_sequence<n_layers - 2>{});
+		std::get<n_layers - 1>(layers_).compute_logits(outs[n_layers - 2], outs[n_layers - 1]);
+	}
+
+	// Backward pass, the gradient of the loss function with respect to the output
+	// layer logits is computed by the output layer from the labels directly
+	template<class In, class Labels>
+	void compute_gradients(const In& in, const Layers_outputs& outs, const Layers_caches& caches,
+		const Labels& labels, Layers_outputs& out_grads, Layers_parameters& param_grads) const
+	{
+		compute_gradients(in, outs, caches, labels, out_grads, param_grads, [](auto) {});
+	}
+
+	// Backward pass that calls on_layer_done(std::integral_constant<std::size_t, index>{})
+	// as soon as the gradient of the trainable layer with the given index is computed
+	template<class In, class Labels, class Layer_done_fn>
+	void compute_gradients(const In& in, const Layers_outputs& outs, const Layers_caches& caches,
+		const Labels& labels, Layers_outputs& out_grads, Layers_parameters& param_grads,
+		Layer_done_fn on_layer_done) const
+	{
+		compute_gradients_impl(in, outs, caches, labels, out_grads, param_grads, on_layer_done, false);
+	}
+
+	// Loss function of outputs of the training forward pass
+	template<class Labels>
+	double compute_loss(const Layers_outputs& outs, const Labels& labels) const
+	{
+		return std::get<n_layers - 1>(layers_).loss(outs.back(), labels);
 	}
 
 	template<class In>
@@ -101,12 +254,83 @@ public:
 		return internal::Classifier{*this}(in);
 	}
 
+	// Returns labels and writes class probabilities
+	// and confidences of all samples into the raster
+	template<class In>
+	esl::Vector_x<std::size_t> classify(const In& in, const Probability_raster_writer& writer) const
+	{
+		assert(in.rows() == input_size_);
+		return internal::Classifier{*this}(in, writer);
+	}
+
+	// Reuses labels of spectra stored in the cache and assigns
+	// the no-data label to no-data samples without classifying them;
+	// labels cached with other parameters are dropped
+	template<class In>
+	esl::Vector_x<std::size_t> classify(const In& in, Classification_cache& cache) const
+	{
+		assert(in.rows() == input_size_);
+		cache.set_params_version(params_version_);
+		return internal::Classifier{*this}(in, cache);
+	}
+
+	// Classifies only samples with non-zero mask values,
+	// other samples get the no-data label
+	template<class In, class Mask>
+	esl::Vector_x<std::size_t> classify(const In& in, const Mask& mask, std::size_t no_data_label) const
+	{
+		assert(in.rows() == input_size_);
+		return internal::Classifier{*this}(in, mask, no_data_label);
+	}
+
+	// Returns k most probable labels for each sample together with their
+	// probabilities, which are calibrated with the given softmax temperature;
+	// k should not exceed the number of classes, the temperature should be positive
+	template<class In>
+	Top_k_classification classify(const In& in, std::size_t k, double temperature = 1) const
+	{
+		assert(in.rows() == input_size_);
+		return internal::Classifier{*this}(in, k, temperature);
+	}
+
+	// Classifies samples and returns the confusion matrix of predicted and true labels,
+	// predicted labels are not stored, so the number of samples is not limited by memory
+	template<class In, class Labels>
+	Confusion_matrix evaluate(const In& in, const Labels& true_labels) const
+	{
+		return evaluate(in, true_labels, Confusion_matrix::no_label);
+	}
+
+	// Samples with the ignored true label (e.g., unlabelled pixels) are not evaluated
+	template<class In, class Labels>
+	Confusion_matrix evaluate(const In& in, const Labels& true_labels, std::size_t ignored_label) const
+	{
+		assert(in.rows() == input_size_);
+		return internal::Classifier{*this}(in, true_labels, output_size(), ignored_label);
+	}
+
+	// Classifies the image read tile by tile: reading, classification and writing
+	// overlap, write(const Classified_tile&) is called from a separate thread
+	template<class Tile_reader, class Write_fn>
+	void classify_tiles(Tile_reader& reader, Write_fn write, bool with_probabilities = false) const
+	{
+		assert(reader.spectrum_size() == input_size_);
+		const internal::Classifier classifier{*this};
+		internal::Scene_classifier{classifier, n_threads()}(reader, write, with_probabilities);
+	}
+
 	template<class In, class Labels, class Callback_fn>
 	esl::Vector_xd train(
 		const In& in, const Labels& labels, unsigned int n_iters, double rate, Callback_fn callback_fn)
 	{
 		assert(in.rows() == input_size_);
-		return internal::Trainer{*this}(in, labels, n_iters, rate, callback_fn);
+		return with_dense_weights([this, &in, &labels, n_iters, rate, &callback_fn]()
+		{
+			return with_transformed_input(in, [this, &labels, n_iters, rate, &callback_fn](const auto& tr_in)
+			{
+				return internal::Trainer{*this}(tr_in, labels, n_iters, rate, callback_fn);
+			});
+		});
 	}
 
 	template<class In, class Labels>
@@ -115,6 +339,73 @@ public:
 		return train(in, labels, n_iters, rate, [](auto...) {});
 	}
 
+	// Asynchronous training, threads update parameters without synchronization
+	template<class In, class Labels, class Callback_fn>
+	esl::Vector_xd train_async(
+		const In& in, const Labels& labels, unsigned int n_iters, double rate, Callback_fn callback_fn)
+	{
+		assert(in.rows() == input_size_);
+		return with_dense_weights([this, &in, &labels, n_iters, rate, &callback_fn]()
+		{
+			return with_transformed_input(in, [this, &labels, n_iters, rate, &callback_fn](const auto& tr_in)
+			{
+				return internal::Async_trainer{*this}(tr_in, labels, n_iters, rate, callback_fn);
+			});
+		});
+	}
+
+	template<class In, class Labels>
+	esl::Vector_xd train_async(const In& in, const Labels& labels, unsigned int n_iters, double rate)
+	{
+		return train_async(in, labels, n_iters, rate, [](auto...) {});
+	}
+
+	// Data-parallel training in several processes connected by the communicator;
+	// each process passes its own part of the training set, parameters are taken
+	// from the process with rank 0 and gradients are summed over all processes,
+	// the returned loss function is that of the whole training set
+	template<class In, class Labels, class Callback_fn>
+	esl::Vector_xd train(const In& in, const Labels& labels, Communicator& comm, unsigned int n_iters, double rate,
+		Callback_fn callback_fn)
+	{
+		assert(in.rows() == input_size_);
+		return with_dense_weights([this, &in, &labels, &comm, n_iters, rate, &callback_fn]()
+		{
+			return with_transformed_input(in, [this, &labels, &comm, n_iters, rate, &callback_fn](const auto& tr_in)
+			{
+				return internal::Distributed_trainer{*this, comm}(tr_in, labels, n_iters, rate, callback_fn);
+			});
+		});
+	}
+
+	// Trains on samples with non-zero mask values only
+	template<class In, class Labels, class Mask, class Callback_fn>
+	esl::Vector_xd train(const In& in, const Labels& labels, const Mask& mask, unsigned int n_iters, double rate,
+		Callback_fn callback_fn)
+	{
+		assert(in.cols() == mask.size() && labels.size() == mask.size());
+
+		const auto indices = valid_indices(mask);
+		if (indices.empty())
+			throw std::runtime_error("No training samples are selected by the mask");
+
+		return train(gather_cols(in, indices), gather_rows(labels, indices), n_iters, rate, callback_fn);
+	}
+
+	// Sets the given fraction of weights with the smallest magnitudes to zero in each layer
+	// that has sparse kernels (fully connected and output layers); the pruned network
+	// can be fine-tuned with train(), pruned weights then stay zero; sparse kernels
+	// are used for the forward pass of layers with low enough density of weights
+	void prune(double fraction)
+	{
+		for_each_sparse_layer([fraction](auto& layer)
+		{
+			layer.prune(fraction);
+			layer.update_sparse_weights();
+		});
+		params_version_ = internal::next_params_version();
+	}
+
 	std::string info_string() const
 	{
 		std::string info = "Neural network contains " + std::to_string(n_layers) + " layers:\n";
@@ -126,27 +417,123 @@ public:
 		return info;
 	}
 
+	// Checks gradients of n_params_per_layer randomly chosen weights and as many
+	// biases of each trainable layer against central differences with the given step;
+	// returns the maximum relative error for each layer and whether it is within the tolerance
 	template<class In, class Labels>
-	void check_gradients(const In& in, const Labels& labels)
+	std::vector<Layer_gradient_check> check_gradients(const In& in, const Labels& labels,
+		std::size_t n_params_per_layer = 50, double tolerance = 1e-4, double delta = 1e-5) const
 	{
 		assert(in.cols() == labels.size());
-		const auto n = labels.size();
 
-		const Layers_outputs outs = compute_outputs(in);
-		Layers_outputs out_grads;
-		Layers_parameters param_grads;
+		return with_transformed_input(in, [this, &labels, n_params_per_layer, tolerance, delta](const auto& tr_in)
+		{
+			return internal::Gradient_checker{*this}(tr_in, labels, n_params_per_layer, tolerance, delta);
+		});
+	}
+
+	// Writes the input transform and parameters of all layers
+	void save(std::ostream& out) const
+	{
+		const auto layout = std::get<0>(layers_).layout();
+		out << "Neural_network " << n_layers << ' ' << input_size_ << ' '
+			<< (layout == Activation_layout::pixel_major ? 1 : 0) << ' ' << (input_transform_ ? 1 : 0) << '\n';
 
-		auto& last_grad = out_grads[n_layers - 1];
-		last_grad.resize(outs[n_layers - 1].rows(), outs[n_layers - 1].cols());
-		last_grad = 0;
-		for (std::size_t col = 0; col < n; ++col)
-			last_grad(labels[col], col) = -1 / outs.back()(labels[col], col);
+		if (input_transform_)
+			input_transform_->save(out);
+		esu::tuple_for_each([&out](auto& layer) { layer.save(out); }, layers_);
+	}
 
-		compute_gradients(in, outs, out_grads, param_grads);
-		check_gradients_impl(Loss_fn_calculator{*this, in, labels}, param_grads);
+	// Reads and initializes the network saved by save(),
+	// the network should have the same layers
+	void load(std::istream& in)
+	{
+		std::string tag;
+		std::size_t n, input_size;
+		int pixel_major, has_transform;
+		in >> tag >> n >> input_size >> pixel_major >> has_transform;
+		if (!in || tag != "Neural_network" || n != n_layers)
+			throw std::runtime_error("Bad neural network data");
+
+		input_transform_.reset();
+		if (has_transform)
+			input_transform_ = Pca_transform::load(in);
+
+		init(Const_init{0}, input_size,
+			pixel_major ? Activation_layout::pixel_major : Activation_layout::feature_major);
+		esu::tuple_for_each([&in](auto& layer) { layer.load(in); }, layers_);
+		for_each_sparse_layer([](auto& layer) { layer.update_sparse_weights(); });
+		params_version_ = internal::next_params_version();
 	}
 
 private:
+	// Calls fn with the input data transformed by the input transform, if any
+	template<class In, class Fn>
+	decltype(auto) with_transformed_input(const In& in, Fn fn) const
+	{
+		if (input_transform_)
+			return fn(input_transform_->apply(in));
+		else
+			return fn(in);
+	}
+
+	// Training forward and backward passes over chunks of at most train_chunk_size_ samples,
+	// gradients are summed over chunks and on_layer_done() is called in the backward pass
+	// of the last chunk only; returns the loss function of all samples
+	template<class In, class Labels, class Layer_done_fn>
+	double compute_loss_and_gradients(const In& in, const Labels& labels, Layers_outputs& outs, Layers_caches& caches,
+		Layers_outputs& out_grads, Layers_parameters& param_grads, Layer_done_fn on_layer_done) const
+	{
+		assert(in.cols() == labels.size());
+
+		const auto n_samples = in.cols();
+		const auto chunk_size = train_chunk_size_ > 0 ? train_chunk_size_ : n_samples;
+
+		double loss = 0;
+		for (std::size_t first = 0; first < n_samples; first += chunk_size)
+		{
+			const auto n = std::min(n_samples - first, chunk_size);
+			const auto chunk_in = in.cols_view(first, n);
+			const auto chunk_labels = labels.rows_view(first, n);
+
+			compute_outputs(chunk_in, outs, caches);
+			if (first + n < n_samples)
+			{
+				auto skip = [](auto) {};
+				compute_gradients_impl(chunk_in, outs, caches, chunk_labels, out_grads, param_grads, skip, first > 0);
+			}
+			else
+				compute_gradients_impl(
+					chunk_in, outs, caches, chunk_labels, out_grads, param_grads, on_layer_done, first > 0);
+
+			loss += compute_loss(outs, chunk_labels);
+		}
+
+		return loss;
+	}
+
+	// Calls fn(layer) for layers that have sparse kernels
+	template<class Fn>
+	void for_each_sparse_layer(Fn fn)
+	{
+		esu::tuple_for_each([&fn](auto& layer)
+		{
+			if constexpr (std::remove_reference_t<decltype(layer)>::has_sparse_kernel)
+				fn(layer);
+		}, layers_);
+	}
+
+	// Training updates dense weights, sparse ones are rebuilt afterwards
+	template<class Fn>
+	auto with_dense_weights(Fn fn)
+	{
+		for_each_sparse_layer([](auto& layer) { layer.drop_sparse_weights(); });
+		params_version_ = internal::next_params_version();
+		auto loss = fn();
+		for_each_sparse_layer([](auto& layer) { layer.update_sparse_weights(); });
+		return loss;
+	}
+
 	template<class Strategy, std::size_t... indices>
 	void init_impl(Strategy&& init_strategy, std::index_sequence<indices...>)
 	{
@@ -159,19 +546,49 @@ private:
 		(std::get<indices + 1>(layers_).compute_output(outs[indices], outs[indices + 1]), ...);
 	}
 
-	template<std::size_t index = n_layers - 1, class In>
-	void compute_gradients_impl(
-		const In& in, const Layers_outputs& outs, Layers_outputs& out_grads, Layers_parameters& param_grads) const
+	template<std::size_t... indices>
+	void compute_outputs_impl(Layers_outputs& outs, Layers_caches& caches, std::index_sequence<indices...>) const
+	{
+		(compute_output<indices + 1>(outs[indices], outs[indices + 1], caches), ...);
+	}
+
+	template<std::size_t index, class In>
+	void compute_output(const In& in, esl::Matrix_xd& out, Layers_caches& caches) const
+	{
+		if constexpr (std::is_same_v<std::tuple_element_t<index, Layers_caches>, Empty_cache>)
+			std::get<index>(layers_).compute_output(in, out);
+		else
+			std::get<index>(layers_).compute_output(in, out, std::get<index>(caches));
+	}
+
+	template<std::size_t index = n_layers - 1, class In, class Labels, class Layer_done_fn>
+	void compute_gradients_impl(const In& in, const Layers_outputs& outs, const Layers_caches& caches,
+		const Labels& labels, Layers_outputs& out_grads, Layers_parameters& param_grads,
+		Layer_done_fn& on_layer_done, bool accumulate) const
 	{
-		if constexpr (std::is_same_v<std::tuple_element_t<index, Layers_parameters>, Empty_parameters>)
+		if constexpr (index == n_layers - 1)
+		{
+			if (!accumulate)
+				std::get<index>(layers_).reset(std::get<index>(param_grads));
+			std::get<index>(layers_).compute_gradient(
+				outs[index - 1], outs[index], labels, out_grads[index - 1], std::get<index>(param_grads));
+		}
+		else if constexpr (std::is_same_v<std::tuple_element_t<index, Layers_parameters>, Empty_parameters>)
 		{
 			if constexpr (index > 0)
-				std::get<index>(layers_).compute_gradient(
-					outs[index - 1], outs[index], out_grads[index - 1], out_grads[index]);
+			{
+				if constexpr (std::is_same_v<std::tuple_element_t<index, Layers_caches>, Empty_cache>)
+					std::get<index>(layers_).compute_gradient(
+						outs[index - 1], outs[index], out_grads[index - 1], out_grads[index]);
+				else
+					std::get<index>(layers_).compute_gradient(outs[index - 1], outs[index],
+						std::get<index>(caches), out_grads[index - 1], out_grads[index]);
+			}
 		}
 		else
 		{
-			std::get<index>(layers_).reset(std::get<index>(param_grads));
+			if (!accumulate)
+				std::get<index>(layers_).reset(std::get<index>(param_grads));
 			if constexpr (index > 0)
 				std::get<index>(layers_).compute_gradient(
 					outs[index - 1], outs[index], out_grads[index - 1], out_grads[index], std::get<index>(param_grads));
@@ -180,8 +597,12 @@ private:
 					in, outs[index], out_grads[index], std::get<index>(param_grads));
 		}
 
+		if constexpr (!std::is_same_v<std::tuple_element_t<index, Layers_parameters>, Empty_parameters>)
+			on_layer_done(std::integral_constant<std::size_t, index>{});
+
 		if constexpr (index > 0)
-			compute_gradients_impl<index - 1>(in, outs, out_grads, param_grads);
+			compute_gradients_impl<index - 1>(
+				in, outs, caches, labels, out_grads, param_grads, on_layer_done, accumulate);
 	}
 
 	template<std::size_t index = n_layers - 1>
@@ -194,17 +615,6 @@ private:
 			add_gradients<index - 1>(alpha, param_grads);
 	}
 
-	template<std::size_t index = n_layers - 1, class Loss_fn>
-	void check_gradients_impl(const Loss_fn& loss_fn, Layers_parameters param_grads)
-	{
-		std::cout << "Checking " << std::get<index>(layers_).name() << std::endl;
-		if constexpr (!std::is_same_v<std::tuple_element_t<index, Layers_parameters>, Empty_parameters>)
-			std::get<index>(layers_).check_gradient(loss_fn, std::get<index>(param_grads));
-
-		if constexpr (index > 0)
-			check_gradients_impl<index - 1>(loss_fn, param_grads);
-	}
-
 private:
 	template<std::size_t... indices, class Tuple>
 	Neural_network(std::index_sequence<indices...>, Tuple&& tuple) :
@@ -215,6 +625,12 @@ private:
 private:
 	Layers_tuple layers_;
 	std::size_t input_size_;
+	std::optional<Pca_transform> input_transform_;
+	unsigned int n_threads_ = 0;
+	std::size_t batch_size_ = 1024;
+	std::size_t train_chunk_size_ = 0;
+	bool pin_threads_ = false;
+	std::uint64_t params_version_ = internal::next_params_version();
 };
 
 template<class... Layers>
@@ -4,14 +4,14 @@
 #include <cstddef>
 #include <random>
 
+// Uniformly distributed values in [-max, max]; networks trained for
+// an ensemble should be initialized with different seeds
 class Random_init
 {
 public:
-	Random_init(double max) : max_(max)
+	Random_init(double max, unsigned int seed = 0) : max_(max)
 	{
-// 		std::random_device rd;
-// 		generator_.seed(rd());
-		generator_.seed(0);
+		generator_.seed(seed);
 	}
 
 	template<std::size_t rows, std::size_t cols>
@@ -0,0 +1,134 @@
+#pragma once
+#include "../spectral_image.hpp"
+#include "../util/bounded_queue.hpp"
+
+#include <esl/dense.hpp>
+
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+struct Classified_tile
+{
+	std::size_t first_row;
+	std::size_t first_col;
+	std::size_t rows;
+	std::size_t cols;
+	// Labels and probabilities of pixels in the Image_tile order,
+	// probabilities are empty if they have not been requested
+	esl::Vector_x<std::size_t> labels;
+	esl::Matrix_xd probabilities;
+};
+
+namespace internal
+{
+// Classifies an image in three overlapping stages connected by bounded queues:
+// the calling thread reads tiles, worker threads classify them, and the writer
+// thread passes classified tiles to write() in the order of their completion;
+// the number of tiles in flight is bounded, so the image is never stored whole;
+// Tile_classifier::classify_sequentially() classifies a tile in a worker thread
+template<class Tile_classifier>
+class Scene_classifier
+{
+public:
+	Scene_classifier(const Tile_classifier& classifier, std::size_t n_workers) :
+		classifier_(classifier), n_workers_(n_workers)
+	{}
+
+	// Tile_reader::next(Image_tile&) returns false if there are no more tiles
+	template<class Tile_reader, class Write_fn>
+	void operator()(Tile_reader& reader, Write_fn write, bool with_probabilities) const
+	{
+		Bounded_queue<Image_tile> tiles(queue_size_per_worker * n_workers_);
+		Bounded_queue<Classified_tile> classified_tiles(queue_size_per_worker * n_workers_);
+
+		// On the first exception all stages stop,
+		// and it is rethrown after they have finished
+		std::exception_ptr error;
+		std::mutex error_mutex;
+		const auto abort = [&]()
+		{
+			{
+				std::lock_guard lock(error_mutex);
+				if (!error)
+					error = std::current_exception();
+			}
+			tiles.close();
+			classified_tiles.close();
+		};
+
+		std::thread writer([&]()
+		{
+			try
+			{
+				Classified_tile tile;
+				while (classified_tiles.pop(tile))
+					write(static_cast<const Classified_tile&>(tile));
+			}
+			catch (...)
+			{
+				abort();
+			}
+		});
+
+		std::vector<std::thread> workers;
+		for (std::size_t w = 0; w < n_workers_; ++w)
+			workers.emplace_back([&]()
+			{
+				try
+				{
+					Image_tile tile;
+					while (tiles.pop(tile))
+					{
+						Classified_tile classified{tile.first_row, tile.first_col, tile.rows, tile.cols, {}, {}};
+						if (with_probabilities)
+							classifier_.classify_sequentially(tile.data, classified.labels, classified.probabilities);
+						else
+							classifier_.classify_sequentially(tile.data, classified.labels);
+
+						if (!classified_tiles.push(std::move(classified)))
+							break;
+					}
+				}
+				catch (...)
+				{
+					abort();
+				}
+			});
+
+		try
+		{
+			while (true)
+			{
+				Image_tile tile;
+				if (!reader.next(tile) || !tiles.push(std::move(tile)))
+					break;
+			}
+		}
+		catch (...)
+		{
+			abort();
+		}
+
+		tiles.close();
+		for (auto& w : workers)
+			w.join();
+
+		classified_tiles.close();
+		writer.join();
+
+		if (error)
+			std::rethrow_exception(error);
+	}
+
+private:
+	// Tiles read ahead or waiting to be written, per worker thread
+	static constexpr std::size_t queue_size_per_worker = 2;
+
+	const Tile_classifier& classifier_;
+	const std::size_t n_workers_;
+};
+} // namespace internal
@@ -1,4 +1,6 @@
 #pragma once
+#include "../util/thread_affinity.hpp"
+
 #include <esl/dense.hpp>
 #include <esu/thread.hpp>
 
@@ -10,6 +12,21 @@
 
 namespace internal
 {
+// Calls fn with the worker's slice of input data; pinned workers train on their
+// own copies of slices made by the workers themselves, so that with the first-touch
+// policy their pages (as well as the workers' scratch storage allocated later)
+// are placed on the NUMA nodes the workers run on; if the thread cannot be pinned
+// (e.g., in a restricted cpuset), it is not worth copying and the slice is used directly
+template<class In, class Fn>
+void with_worker_input(const In& in, std::size_t worker, bool pin_thread, Fn fn)
+{
+	if (!pin_thread || !pin_current_thread(worker))
+		return fn(in);
+
+	const esl::Matrix_xd local_in = in;
+	fn(local_in);
+}
+
 template<class Network>
 class Trainer
 {
@@ -23,9 +40,14 @@ public:
 	{
 		assert(in.cols() == labels.size());
 
-		const auto n_workers = std::max(1u, std::thread::hardware_concurrency());
+		assert(labels.size() > 0);
+
 		const auto n_samples = labels.size();
-		const auto n_samples_per_worker = (n_samples + n_workers - 1) / n_workers;
+		const std::size_t n_threads = network_.n_threads();
+		const auto n_samples_per_worker = (n_samples + n_threads - 1) / n_threads;
+
+		// No worker gets an empty set of samples
+		const auto n_workers = (n_samples + n_samples_per_worker - 1) / n_samples_per_worker;
 
 		std::vector<std::thread> workers;
 
@@ -46,15 +68,18 @@ public:
 			callback_fn(it, loss_function[it]);
 		});
 
-		for (unsigned int i = 0; i < n_workers; ++i)
+		for (std::size_t i = 0; i < n_workers; ++i)
 		{
 			const auto first = i * n_samples_per_worker;
 			const auto n = std::min(n_samples - first, n_samples_per_worker);
 
 			workers.emplace_back([&, n, first, i, this]()
 			{
-				train_step(in.cols_view(first, n), labels.rows_view(first, n), wrk_param_grads[i], wrk_loss_function[i],
-					barrier, n_iters);
+				with_worker_input(in.cols_view(first, n), i, network_.pin_threads_, [&](const auto& wrk_in)
+				{
+					train_step(
+						wrk_in, labels.rows_view(first, n), wrk_param_grads[i], wrk_loss_function[i], barrier, n_iters);
+				});
 			});
 		}
 
@@ -66,30 +91,19 @@ public:
 
 private:
 	template<class In, class Labels, class Barrier>
-	void train_step(In in, Labels labels, typename Network::Layers_parameters& param_grads, double& loss_function,
+	void train_step(const In& in, Labels labels, typename Network::Layers_parameters& param_grads, double& loss_function,
 		Barrier& barrier, unsigned int n_iters)
 	{
-		const auto n = labels.size();
-		assert(in.cols() == n);
+		assert(in.cols() == labels.size());
 
 		typename Network::Layers_outputs outs;
+		typename Network::Layers_caches caches;
 		typename Network::Layers_outputs out_grads;
 
 		for (unsigned int it = 0; it < n_iters; ++it)
 		{
-			network_.compute_outputs(in, outs);
-
-			auto& last_grad = out_grads.back();
-			last_grad.resize(outs.back().rows(), outs.back().cols());
-			last_grad = 0;
-			for (std::size_t j = 0; j < n; ++j)
-				last_grad(labels[j], j) = -1 / outs.back()(labels[j], j);
-
-			network_.compute_gradients(in, outs, out_grads, param_grads);
-
-			loss_function = 0;
-			for (std::size_t j = 0; j < n; ++j)
-				loss_function -= std::log(outs.back()(labels[j], j));
+			loss_function =
+				network_.compute_loss_and_gradients(in, labels, outs, caches, out_grads, param_grads, [](auto) {});
 
 			barrier.wait();
 		}
@@ -0,0 +1,242 @@
+#pragma once
+#include <esl/dense.hpp>
+
+#include <mkl_lapacke.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Projection of spectra onto their principal components, optionally
+// whitened (scaled to unit variance): out = projection * (in - mean)
+class Pca_transform
+{
+public:
+	// Computes principal components of spectra (one spectrum per column);
+	// the covariance matrix is accumulated in a single multithreaded pass
+	template<class Data>
+	static Pca_transform fit(const Data& data, std::size_t n_components, bool whiten = false)
+	{
+		const auto dim = data.rows();
+		const auto n = data.cols();
+		assert(n_components > 0 && n_components <= dim);
+		assert(n > 1);
+
+		// The first spectrum is subtracted from all spectra
+		// to reduce cancellation errors in the covariance
+		const esl::Vector_xd shift = data.col_view(0);
+		const auto [sum, scatter] = accumulate_moments(data, shift);
+
+		esl::Vector_xd mean = sum;
+		mean /= static_cast<double>(n);
+
+		esl::Matrix_xd covariance(dim, dim);
+		for (std::size_t j = 0; j < dim; ++j)
+			for (std::size_t i = 0; i < dim; ++i)
+				covariance(i, j) = (scatter(i, j) - n * mean[i] * mean[j]) / (n - 1);
+
+		esl::Vector_xd eigenvalues(dim);
+		const auto info = ::LAPACKE_dsyevd(LAPACK_COL_MAJOR, 'V', 'U', static_cast<lapack_int>(dim),
+			covariance.data(), static_cast<lapack_int>(dim), eigenvalues.data());
+		if (info != 0)
+			throw std::runtime_error("PCA eigendecomposition failed");
+
+		mean += shift;
+
+		// Eigenvalues are in the ascending order
+		Pca_transform pca;
+		pca.whiten_ = whiten;
+		pca.mean_ = mean;
+		pca.projection_.resize(n_components, dim);
+		pca.explained_variance_.resize(n_components);
+		for (std::size_t k = 0; k < n_components; ++k)
+		{
+			const auto col = dim - 1 - k;
+			const auto variance = std::max(eigenvalues[col], 0.);
+			const auto scale = whiten ? 1 / std::sqrt(variance + min_variance) : 1.;
+
+			pca.explained_variance_[k] = variance;
+			for (std::size_t i = 0; i < dim; ++i)
+				pca.projection_(k, i) = scale * covariance(i, col);
+		}
+
+		pca.update_offset();
+		return pca;
+	}
+
+	// Transforms spectra (one spectrum per column) with a single GEMM
+	template<class In>
+	esl::Matrix_xd apply(const In& in) const
+	{
+		assert(in.rows() == input_size());
+
+		esl::Matrix_xd out(output_size(), in.cols());
+		out = projection_ * in;
+		for (std::size_t j = 0; j < out.cols(); ++j)
+			out.col_view(j) -= offset_;
+
+		return out;
+	}
+
+	std::size_t input_size() const
+	{
+		return projection_.cols();
+	}
+
+	std::size_t output_size() const
+	{
+		return projection_.rows();
+	}
+
+	bool is_whitened() const
+	{
+		return whiten_;
+	}
+
+	// Variances of spectra along principal components, in the decreasing order
+	const esl::Vector_xd& explained_variance() const
+	{
+		return explained_variance_;
+	}
+
+	void save(std::ostream& out) const
+	{
+		const auto precision = out.precision(17);
+		out << "Pca_transform " << input_size() << ' ' << output_size() << ' ' << (whiten_ ? 1 : 0) << '\n';
+
+		for (std::size_t i = 0; i < input_size(); ++i)
+			out << mean_[i] << ' ';
+		out << '\n';
+
+		for (std::size_t k = 0; k < output_size(); ++k)
+			out << explained_variance_[k] << ' ';
+		out << '\n';
+
+		for (std::size_t k = 0; k < output_size(); ++k)
+		{
+			for (std::size_t i = 0; i < input_size(); ++i)
+				out << projection_(k, i) << ' ';
+			out << '\n';
+		}
+
+		out.precision(precision);
+	}
+
+	static Pca_transform load(std::istream& in)
+	{
+		std::string tag;
+		std::size_t input_size, output_size;
+		int whiten;
+		in >> tag >> input_size >> output_size >> whiten;
+		if (!in || tag != "Pca_transform")
+			throw std::runtime_error("Bad PCA transform data");
+
+		Pca_transform pca;
+		pca.whiten_ = (whiten != 0);
+		pca.mean_.resize(input_size);
+		pca.explained_variance_.resize(output_size);
+		pca.projection_.resize(output_size, input_size);
+
+		for (std::size_t i = 0; i < input_size; ++i)
+			in >> pca.mean_[i];
+		for (std::size_t k = 0; k < output_size; ++k)
+			in >> pca.explained_variance_[k];
+		for (std::size_t k = 0; k < output_size; ++k)
+			for (std::size_t i = 0; i < input_size; ++i)
+				in >> pca.projection_(k, i);
+
+		if (!in)
+			throw std::runtime_error("Bad PCA transform data");
+
+		pca.update_offset();
+		return pca;
+	}
+
+private:
+	struct Moments
+	{
+		esl::Vector_xd sum;
+		esl::Matrix_xd scatter;
+	};
+
+	// Returns the sum and the scatter matrix (sum of outer products)
+	// of shifted spectra; each thread accumulates its own columns
+	// block by block with rank-k updates
+	template<class Data>
+	static Moments accumulate_moments(const Data& data, const esl::Vector_xd& shift)
+	{
+		const auto dim = data.rows();
+		const auto n_samples = data.cols();
+		const auto n_workers = std::max(1u, std::thread::hardware_concurrency());
+		const auto n_samples_per_worker = (n_samples + n_workers - 1) / n_workers;
+
+		std::vector<Moments> wrk_moments;
+		std::vector<std::thread> workers;
+		for (std::size_t first = 0; first < n_samples; first += n_samples_per_worker)
+			wrk_moments.push_back({esl::Vector_xd(dim), esl::Matrix_xd(dim, dim)});
+
+		for (std::size_t i = 0; i < wrk_moments.size(); ++i)
+		{
+			const auto first = i * n_samples_per_worker;
+			const auto n = std::min(n_samples - first, n_samples_per_worker);
+
+			workers.emplace_back([&data, &shift, &moments = wrk_moments[i], first, n]()
+			{
+				moments.sum = 0;
+				moments.scatter = 0;
+
+				esl::Matrix_xd block;
+				for (std::size_t offset = 0; offset < n; offset += block_size)
+				{
+					const auto block_n = std::min(n - offset, block_size);
+					block = data.cols_view(first + offset, block_n);
+					for (std::size_t j = 0; j < block_n; ++j)
+					{
+						block.col_view(j) -= shift;
+						moments.sum += block.col_view(j);
+					}
+
+					moments.scatter += block * block.tr_view();
+				}
+			});
+		}
+
+		for (auto& w : workers)
+			w.join();
+
+		Moments moments{esl::Vector_xd(dim), esl::Matrix_xd(dim, dim)};
+		moments.sum = 0;
+		moments.scatter = 0;
+		for (auto& m : wrk_moments)
+		{
+			moments.sum += m.sum;
+			moments.scatter += m.scatter;
+		}
+
+		return moments;
+	}
+
+	void update_offset()
+	{
+		offset_ = projection_ * mean_;
+	}
+
+private:
+	// Number of spectra in a rank-k update
+	static constexpr std::size_t block_size = 256;
+	// Regularization of whitening for components with vanishing variance
+	static constexpr double min_variance = 1e-12;
+
+	bool whiten_ = false;
+	esl::Vector_xd mean_;
+	esl::Vector_xd explained_variance_;
+	esl::Matrix_xd projection_;
+	esl::Vector_xd offset_;
+};
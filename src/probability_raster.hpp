@@ -0,0 +1,215 @@
+#pragma once
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+enum class Raster_type : std::uint64_t
+{
+	float32 = 0,
+	float16 = 1,
+	// Probabilities quantized as round(255 * p)
+	uint8 = 2
+};
+
+// Writes per-pixel class probabilities and the maximum probability
+// (confidence) into a band-interleaved-by-pixel binary raster.
+//
+// File layout: 8-byte magic "HSIPROB1", four 64-bit unsigned integers
+// (rows, cols, number of bands, Raster_type), followed by pixels in
+// the Spectral_image order (row + col * rows). Each pixel contains
+// n_classes probabilities followed by the confidence band.
+//
+// Disjoint ranges of pixels can be written concurrently.
+class Probability_raster_writer
+{
+public:
+	Probability_raster_writer(
+		const std::string& file_name, std::size_t rows, std::size_t cols, std::size_t n_classes, Raster_type type) :
+		rows_(rows),
+		n_pixels_(rows * cols), n_bands_(n_classes + 1), type_(type)
+	{
+		fd_ = ::open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd_ < 0)
+			throw std::runtime_error("Cannot open file " + file_name);
+
+		// The destructor is not called if the constructor throws
+		try
+		{
+			const std::uint64_t header[] = {rows, cols, n_bands_, static_cast<std::uint64_t>(type_)};
+			write_bytes(magic, sizeof(magic), 0);
+			write_bytes(header, sizeof(header), sizeof(magic));
+
+			if (::ftruncate(fd_, static_cast<::off_t>(data_offset + n_pixels_ * pixel_size())) != 0)
+				throw std::runtime_error("Cannot resize file " + file_name);
+		}
+		catch (...)
+		{
+			::close(fd_);
+			throw;
+		}
+	}
+
+	Probability_raster_writer(const Probability_raster_writer&) = delete;
+	Probability_raster_writer& operator=(const Probability_raster_writer&) = delete;
+
+	~Probability_raster_writer()
+	{
+		::close(fd_);
+	}
+
+	std::size_t n_classes() const
+	{
+		return n_bands_ - 1;
+	}
+
+	// Writes probabilities (n_classes x n) of pixels [first, first + n)
+	template<class Probabilities>
+	void write(std::size_t first, const Probabilities& probabilities) const
+	{
+		assert(probabilities.rows() == n_classes());
+		assert(first + probabilities.cols() <= n_pixels_);
+
+		const auto n = probabilities.cols();
+		std::vector<unsigned char> buffer(n * pixel_size());
+
+		auto ptr = buffer.data();
+		for (std::size_t j = 0; j < n; ++j)
+		{
+			double confidence = 0;
+			for (std::size_t i = 0; i < n_classes(); ++i)
+			{
+				ptr = encode(probabilities(i, j), ptr);
+				confidence = std::max(confidence, probabilities(i, j));
+			}
+			ptr = encode(confidence, ptr);
+		}
+
+		write_bytes(buffer.data(), buffer.size(), data_offset + first * pixel_size());
+	}
+
+	// Writes probabilities (n_classes x n_rows * n_cols) of the rectangle of pixels with
+	// the top-left corner (first_row, first_col), pixels are stored column by column
+	template<class Probabilities>
+	void write(
+		std::size_t first_row, std::size_t first_col, std::size_t n_rows, const Probabilities& probabilities) const
+	{
+		assert(n_rows > 0 && probabilities.cols() % n_rows == 0);
+		assert(first_row + n_rows <= rows_);
+
+		// Each column of the rectangle is contiguous in the file
+		for (std::size_t col = 0; col < probabilities.cols() / n_rows; ++col)
+			write(first_row + (first_col + col) * rows_, probabilities.cols_view(col * n_rows, n_rows));
+	}
+
+private:
+	std::size_t value_size() const
+	{
+		switch (type_)
+		{
+		case Raster_type::float32:
+			return 4;
+		case Raster_type::float16:
+			return 2;
+		default:
+			return 1;
+		}
+	}
+
+	std::size_t pixel_size() const
+	{
+		return n_bands_ * value_size();
+	}
+
+	unsigned char* encode(double value, unsigned char* ptr) const
+	{
+		switch (type_)
+		{
+		case Raster_type::float32:
+		{
+			const auto v = static_cast<float>(value);
+			std::memcpy(ptr, &v, sizeof(v));
+			return ptr + sizeof(v);
+		}
+
+		case Raster_type::float16:
+		{
+			const auto v = to_half(static_cast<float>(value));
+			std::memcpy(ptr, &v, sizeof(v));
+			return ptr + sizeof(v);
+		}
+
+		default:
+			*ptr = static_cast<unsigned char>(std::lround(255 * value));
+			return ptr + 1;
+		}
+	}
+
+	// Converts a finite non-negative float into IEEE 754 half precision
+	// with rounding to nearest
+	static std::uint16_t to_half(float value)
+	{
+		std::uint32_t x;
+		std::memcpy(&x, &value, sizeof(x));
+
+		const auto sign = static_cast<std::uint16_t>((x >> 16) & 0x8000u);
+		const int exp = static_cast<int>((x >> 23) & 0xffu) - 127 + 15;
+		std::uint32_t mantissa = x & 0x7fffffu;
+
+		if (exp <= 0)
+		{
+			// Subnormal half or zero
+			if (exp < -10)
+				return sign;
+
+			mantissa |= 0x800000u;
+			const auto shift = static_cast<unsigned int>(14 - exp);
+			auto half = static_cast<std::uint16_t>(mantissa >> shift);
+			if ((mantissa >> (shift - 1)) & 1u)
+				++half;
+			return sign | half;
+		}
+
+		if (exp >= 31)
+			return sign | 0x7c00u;
+
+		auto half = static_cast<std::uint16_t>(sign | (exp << 10) | (mantissa >> 13));
+		// Carry into the exponent is the correct rounding result
+		if (mantissa & 0x1000u)
+			++half;
+		return half;
+	}
+
+	void write_bytes(const void* data, std::size_t size, std::size_t offset) const
+	{
+		auto ptr = static_cast<const char*>(data);
+		while (size > 0)
+		{
+			const auto n = ::pwrite(fd_, ptr, size, static_cast<::off_t>(offset));
+			if (n <= 0)
+				throw std::runtime_error("Cannot write probability raster");
+
+			ptr += n;
+			offset += static_cast<std::size_t>(n);
+			size -= static_cast<std::size_t>(n);
+		}
+	}
+
+private:
+	static constexpr char magic[8] = {'H', 'S', 'I', 'P', 'R', 'O', 'B', '1'};
+	static constexpr std::size_t data_offset = sizeof(magic) + 4 * sizeof(std::uint64_t);
+
+	const std::size_t rows_;
+	const std::size_t n_pixels_;
+	const std::size_t n_bands_;
+	const Raster_type type_;
+	int fd_;
+};
@@ -1,8 +1,12 @@
 #pragma once
+#include "spectral_preprocessor.hpp"
+#include "util/text_reader.hpp"
+
 #include <esl/dense.hpp>
 
+#include <algorithm>
 #include <cstddef>
-#include <fstream>
+#include <stdexcept>
 #include <string>
 
 struct Spectral_image
@@ -13,24 +17,175 @@ struct Spectral_image
 	esl::Matrix_xd data;
 };
 
+// Rectangular part of an image, pixel (row, col) is stored
+// in the column (row - first_row) + (col - first_col) * rows
+struct Image_tile
+{
+	std::size_t first_row;
+	std::size_t first_col;
+	std::size_t rows;
+	std::size_t cols;
+	esl::Matrix_xd data;
+};
+
+// Reads a text file that contains spectrum size, number of rows and
+// number of columns followed by pixel spectra in the column-major order
 Spectral_image read_image(const std::string& file_name)
 {
-	std::ifstream file;
-	file.exceptions(std::ifstream::badbit | std::ifstream::failbit);
-	file.open(file_name);
+	const Mapped_file file(file_name);
 
 	Spectral_image image;
-	file >> image.spectrum_size >> image.rows >> image.cols;
+	auto ptr = parse_value(file.begin(), file.end(), image.spectrum_size);
+	ptr = parse_value(ptr, file.end(), image.rows);
+	ptr = parse_value(ptr, file.end(), image.cols);
 
+	// Pixel (row, col) is stored in the column (row + col * rows),
+	// so the file order coincides with the storage order
 	image.data.resize(image.spectrum_size, image.rows * image.cols);
-	for (std::size_t col = 0; col < image.cols; ++col)
-		for (std::size_t row = 0; row < image.rows; ++row)
+	const auto data = image.data.data();
+	parse_values<double>(ptr, file.end(), image.data.size(), [data](std::size_t index, double value)
+	{
+		data[index] = value;
+	});
+
+	return image;
+}
+
+// Reads a text image file applying the pre-processing stage on the fly
+Spectral_image read_image(const std::string& file_name, const Spectral_preprocessor& preprocessor)
+{
+	const Mapped_file file(file_name);
+
+	Spectral_image image;
+	auto ptr = parse_value(file.begin(), file.end(), image.spectrum_size);
+	ptr = parse_value(ptr, file.end(), image.rows);
+	ptr = parse_value(ptr, file.end(), image.cols);
+
+	const auto input_size = image.spectrum_size;
+	if (input_size != preprocessor.input_size())
+		throw std::runtime_error("Inconsistent spectrum size in " + file_name);
+
+	const auto n_pixels = image.rows * image.cols;
+	image.spectrum_size = preprocessor.output_size();
+	image.data.resize(image.spectrum_size, n_pixels);
+
+	const auto data = image.data.data();
+	const auto output_size = image.spectrum_size;
+	for (std::size_t j = 0; j < n_pixels; ++j)
+		preprocessor.init_spectrum(data + j * output_size);
+
+	// Each pixel spectrum is processed by a single thread
+	parse_values<double>(ptr, file.end(), input_size * n_pixels,
+		[input_size](std::size_t index) { return index % input_size == 0; },
+		[&preprocessor, data, input_size, output_size](std::size_t index, double value)
 		{
-			const auto index = row + col * image.rows;
-			for (std::size_t s = 0; s < image.spectrum_size; ++s)
-				file >> image.data(s, index);
-		}
+			preprocessor.add_value(index % input_size, value, data + (index / input_size) * output_size);
+		});
 
 	return image;
 }
 
+// Reads a text file with a label image, rows lines of cols labels each
+// (e.g., ground truth), and returns labels in the Spectral_image order
+esl::Vector_x<std::size_t> read_label_image(const std::string& file_name, std::size_t rows, std::size_t cols)
+{
+	const Mapped_file file(file_name);
+
+	esl::Vector_x<std::size_t> labels(rows * cols);
+	parse_values<std::size_t>(file.begin(), file.end(), labels.size(),
+		[&labels, rows, cols](std::size_t index, std::size_t value)
+		{
+			labels[index / cols + (index % cols) * rows] = value;
+		});
+
+	return labels;
+}
+
+// Reads a text image file tile by tile, each tile contains whole columns
+// of (at least) n_pixels_per_tile pixels; values are parsed sequentially;
+// if the pre-processing stage is given, tiles contain reduced spectra
+class Text_image_tile_reader
+{
+public:
+	Text_image_tile_reader(const std::string& file_name, std::size_t n_pixels_per_tile) : file_(file_name)
+	{
+		ptr_ = parse_value(file_.begin(), file_.end(), spectrum_size_);
+		ptr_ = parse_value(ptr_, file_.end(), rows_);
+		ptr_ = parse_value(ptr_, file_.end(), cols_);
+
+		cols_per_tile_ = std::max<std::size_t>(1, n_pixels_per_tile / std::max<std::size_t>(1, rows_));
+	}
+
+	Text_image_tile_reader(
+		const std::string& file_name, std::size_t n_pixels_per_tile, const Spectral_preprocessor& preprocessor) :
+		Text_image_tile_reader(file_name, n_pixels_per_tile)
+	{
+		if (spectrum_size_ != preprocessor.input_size())
+			throw std::runtime_error("Inconsistent spectrum size in " + file_name);
+		preprocessor_ = &preprocessor;
+	}
+
+	std::size_t rows() const
+	{
+		return rows_;
+	}
+
+	std::size_t cols() const
+	{
+		return cols_;
+	}
+
+	std::size_t spectrum_size() const
+	{
+		return preprocessor_ ? preprocessor_->output_size() : spectrum_size_;
+	}
+
+	// Returns false if there are no more tiles
+	bool next(Image_tile& tile)
+	{
+		if (next_col_ >= cols_)
+			return false;
+
+		tile.first_row = 0;
+		tile.first_col = next_col_;
+		tile.rows = rows_;
+		tile.cols = std::min(cols_per_tile_, cols_ - next_col_);
+		next_col_ += tile.cols;
+
+		// Pixels of whole columns are contiguous in the file
+		const auto n_pixels = tile.rows * tile.cols;
+		tile.data.resize(spectrum_size(), n_pixels);
+		const auto data = tile.data.data();
+		if (!preprocessor_)
+		{
+			for (std::size_t i = 0; i < tile.data.size(); ++i)
+				ptr_ = parse_value(ptr_, file_.end(), data[i]);
+			return true;
+		}
+
+		const auto output_size = preprocessor_->output_size();
+		for (std::size_t j = 0; j < n_pixels; ++j)
+		{
+			preprocessor_->init_spectrum(data + j * output_size);
+			for (std::size_t s = 0; s < spectrum_size_; ++s)
+			{
+				double value;
+				ptr_ = parse_value(ptr_, file_.end(), value);
+				preprocessor_->add_value(s, value, data + j * output_size);
+			}
+		}
+
+		return true;
+	}
+
+private:
+	const Mapped_file file_;
+	const char* ptr_;
+
+	std::size_t spectrum_size_;
+	std::size_t rows_;
+	std::size_t cols_;
+	std::size_t cols_per_tile_;
+	const Spectral_preprocessor* preprocessor_ = nullptr;
+	std::size_t next_col_ = 0;
+};
@@ -0,0 +1,294 @@
+#pragma once
+#include <esl/dense.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <istream>
+#include <limits>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Spectral pre-processing stage that maps input bands into output bands:
+// band removal/selection, binning of adjacent retained bands and per-band
+// normalization. The whole transform is affine,
+//     out[o] = offset[o] + sum_{s : output_band(s) == o} scale(s) * in[s],
+// so it is applied value by value while an image is being read and
+// full-width spectra are never stored.
+class Spectral_preprocessor
+{
+public:
+	static constexpr auto no_band = std::numeric_limits<std::size_t>::max();
+
+public:
+	explicit Spectral_preprocessor(std::size_t input_size) : retained_(input_size, true)
+	{
+		update();
+	}
+
+	// Removes the given (zero-based) bands
+	void remove_bands(const std::vector<std::size_t>& bands)
+	{
+		for (auto band : bands)
+			retained_.at(band) = false;
+		reset_normalization();
+	}
+
+	// Retains only the given (zero-based) bands
+	void select_bands(const std::vector<std::size_t>& bands)
+	{
+		std::fill(retained_.begin(), retained_.end(), false);
+		for (auto band : bands)
+			retained_.at(band) = true;
+		reset_normalization();
+	}
+
+	// Averages groups of bin_size adjacent retained bands
+	void set_bin_size(std::size_t bin_size)
+	{
+		assert(bin_size > 0);
+		bin_size_ = bin_size;
+		reset_normalization();
+	}
+
+	// Computes normalization statistics of output bands from reduced,
+	// not yet normalized spectra (one spectrum per column)
+	template<class Data>
+	void fit_normalization(const Data& data)
+	{
+		assert(data.rows() == output_size());
+		assert(data.cols() > 0);
+
+		mean_.assign(output_size(), 0);
+		std_dev_.assign(output_size(), 0);
+
+		const auto n = data.cols();
+		for (std::size_t j = 0; j < n; ++j)
+			for (std::size_t o = 0; o < output_size(); ++o)
+				mean_[o] += data(o, j);
+		for (auto& m : mean_)
+			m /= n;
+
+		for (std::size_t j = 0; j < n; ++j)
+			for (std::size_t o = 0; o < output_size(); ++o)
+				std_dev_[o] += (data(o, j) - mean_[o]) * (data(o, j) - mean_[o]);
+		for (auto& s : std_dev_)
+			s = std::max(std::sqrt(s / n), min_std_dev);
+
+		update();
+	}
+
+	// Normalizes reduced spectra in place using the stored statistics
+	template<class Data>
+	void normalize(Data& data) const
+	{
+		assert(data.rows() == output_size());
+		if (!is_normalized())
+			return;
+
+		for (std::size_t j = 0; j < data.cols(); ++j)
+			for (std::size_t o = 0; o < output_size(); ++o)
+				data(o, j) = (data(o, j) - mean_[o]) / std_dev_[o];
+	}
+
+	// Applies the transform to full-width spectra (one spectrum per column)
+	template<class In>
+	esl::Matrix_xd apply(const In& in) const
+	{
+		assert(in.rows() == input_size());
+
+		esl::Matrix_xd out(output_size(), in.cols());
+		for (std::size_t j = 0; j < in.cols(); ++j)
+		{
+			init_spectrum(out.col_view(j).data());
+			for (std::size_t s = 0; s < input_size(); ++s)
+				add_value(s, in(s, j), out.col_view(j).data());
+		}
+
+		return out;
+	}
+
+	bool is_normalized() const
+	{
+		return !mean_.empty();
+	}
+
+	std::size_t input_size() const
+	{
+		return retained_.size();
+	}
+
+	std::size_t output_size() const
+	{
+		return offset_.size();
+	}
+
+	std::size_t output_band(std::size_t input_band) const
+	{
+		return output_band_[input_band];
+	}
+
+	// Initializes a reduced spectrum before input values are added
+	void init_spectrum(double* spectrum) const
+	{
+		std::copy(offset_.begin(), offset_.end(), spectrum);
+	}
+
+	// Adds the contribution of the input band value to the reduced spectrum
+	void add_value(std::size_t input_band, double value, double* spectrum) const
+	{
+		const auto o = output_band_[input_band];
+		if (o != no_band)
+			spectrum[o] += scale_[input_band] * value;
+	}
+
+	// Returns true if input bands before the given one and input bands
+	// starting from it contribute into disjoint sets of output bands
+	bool can_split_before(std::size_t input_band) const
+	{
+		return can_split_before_[input_band];
+	}
+
+	void save(std::ostream& out) const
+	{
+		const auto precision = out.precision(17);
+		out << "Spectral_preprocessor " << input_size() << ' ' << bin_size_ << ' ' << (is_normalized() ? 1 : 0)
+			<< '\n';
+
+		for (bool r : retained_)
+			out << (r ? 1 : 0) << ' ';
+		out << '\n';
+
+		if (is_normalized())
+			for (std::size_t o = 0; o < output_size(); ++o)
+				out << mean_[o] << ' ' << std_dev_[o] << '\n';
+
+		out.precision(precision);
+	}
+
+	static Spectral_preprocessor load(std::istream& in)
+	{
+		std::string tag;
+		std::size_t input_size, bin_size;
+		int normalized;
+		in >> tag >> input_size >> bin_size >> normalized;
+		if (!in || tag != "Spectral_preprocessor" || bin_size == 0)
+			throw std::runtime_error("Bad spectral pre-processor data");
+
+		Spectral_preprocessor pp(input_size);
+		pp.bin_size_ = bin_size;
+		for (std::size_t s = 0; s < input_size; ++s)
+		{
+			int r;
+			in >> r;
+			pp.retained_[s] = (r != 0);
+		}
+		pp.update();
+
+		if (normalized)
+		{
+			pp.mean_.resize(pp.output_size());
+			pp.std_dev_.resize(pp.output_size());
+			for (std::size_t o = 0; o < pp.output_size(); ++o)
+				in >> pp.mean_[o] >> pp.std_dev_[o];
+			pp.update();
+		}
+
+		if (!in)
+			throw std::runtime_error("Bad spectral pre-processor data");
+		return pp;
+	}
+
+	friend bool operator==(const Spectral_preprocessor& pp1, const Spectral_preprocessor& pp2)
+	{
+		return pp1.retained_ == pp2.retained_ && pp1.bin_size_ == pp2.bin_size_ && pp1.mean_ == pp2.mean_ &&
+			   pp1.std_dev_ == pp2.std_dev_;
+	}
+
+	// Water absorption bands of 224-band AVIRIS scenes (zero-based):
+	// 104-108, 150-163 and 220 in one-based numbering
+	static std::vector<std::size_t> aviris_water_absorption_bands()
+	{
+		std::vector<std::size_t> bands;
+		for (std::size_t band = 103; band <= 107; ++band)
+			bands.push_back(band);
+		for (std::size_t band = 149; band <= 162; ++band)
+			bands.push_back(band);
+		bands.push_back(219);
+		return bands;
+	}
+
+private:
+	void reset_normalization()
+	{
+		mean_.clear();
+		std_dev_.clear();
+		update();
+	}
+
+	void update()
+	{
+		output_band_.assign(input_size(), no_band);
+		scale_.assign(input_size(), 0);
+
+		std::size_t n_retained = 0;
+		for (std::size_t s = 0; s < input_size(); ++s)
+			if (retained_[s])
+				output_band_[s] = n_retained++ / bin_size_;
+
+		const auto n_outputs = (n_retained + bin_size_ - 1) / bin_size_;
+		std::vector<std::size_t> bin_counts(n_outputs, 0);
+		for (auto o : output_band_)
+			if (o != no_band)
+				++bin_counts[o];
+
+		offset_.assign(n_outputs, 0);
+		for (std::size_t s = 0; s < input_size(); ++s)
+		{
+			const auto o = output_band_[s];
+			if (o == no_band)
+				continue;
+
+			scale_[s] = 1. / bin_counts[o];
+			if (is_normalized())
+				scale_[s] /= std_dev_[o];
+		}
+
+		if (is_normalized())
+			for (std::size_t o = 0; o < n_outputs; ++o)
+				offset_[o] = -mean_[o] / std_dev_[o];
+
+		// Output bands of retained input bands are non-decreasing, so it is
+		// enough to compare the last retained band before and the next one
+		std::vector<std::size_t> prev_output(input_size(), no_band);
+		for (std::size_t s = 1; s < input_size(); ++s)
+			prev_output[s] = (output_band_[s - 1] != no_band) ? output_band_[s - 1] : prev_output[s - 1];
+
+		can_split_before_.assign(input_size(), true);
+		auto next_output = no_band;
+		for (auto s = input_size(); s-- > 0;)
+		{
+			if (output_band_[s] != no_band)
+				next_output = output_band_[s];
+			can_split_before_[s] =
+				(prev_output[s] == no_band || next_output == no_band || prev_output[s] != next_output);
+		}
+	}
+
+private:
+	static constexpr double min_std_dev = 1e-12;
+
+	std::vector<bool> retained_;
+	std::size_t bin_size_ = 1;
+
+	std::vector<double> mean_;
+	std::vector<double> std_dev_;
+
+	std::vector<std::size_t> output_band_;
+	std::vector<bool> can_split_before_;
+	std::vector<double> scale_;
+	std::vector<double> offset_;
+};
@@ -1,9 +1,11 @@
 #pragma once
+#include "spectral_preprocessor.hpp"
+#include "util/text_reader.hpp"
+
 #include <esl/dense.hpp>
 
-#include <cassert>
 #include <cstddef>
-#include <fstream>
+#include <stdexcept>
 #include <string>
 
 struct Spectral_train_set
@@ -15,31 +17,86 @@ struct Spectral_train_set
 	esl::Matrix_xd data;
 };
 
+// Reads a labels text file that contains number of label values
+// and number of samples followed by labels
+void read_labels(const std::string& labels_file_name, Spectral_train_set& train_set)
+{
+	const Mapped_file labels_file(labels_file_name);
+
+	std::size_t labels_size;
+	auto ptr = parse_value(labels_file.begin(), labels_file.end(), train_set.n_label_values);
+	ptr = parse_value(ptr, labels_file.end(), labels_size);
+	if (labels_size != train_set.size)
+		throw std::runtime_error("Inconsistent number of samples in " + labels_file_name);
+
+	train_set.labels.resize(labels_size);
+	auto& labels = train_set.labels;
+	parse_values<std::size_t>(ptr, labels_file.end(), labels_size, [&labels](std::size_t index, std::size_t value)
+	{
+		labels[index] = value;
+	});
+}
+
+// Reads a data text file that contains spectrum size and number of samples
+// followed by spectra stored band by band, and a labels text file
+// that contains number of label values and number of samples followed by labels
 Spectral_train_set read_train_set(const std::string& data_file_name, const std::string& labels_file_name)
 {
-	std::ifstream data_file;
-	data_file.exceptions(std::ifstream::badbit | std::ifstream::failbit);
-	data_file.open(data_file_name);
+	Spectral_train_set train_set;
 
+	{
+		const Mapped_file data_file(data_file_name);
+		auto ptr = parse_value(data_file.begin(), data_file.end(), train_set.spectrum_size);
+		ptr = parse_value(ptr, data_file.end(), train_set.size);
+
+		train_set.data.resize(train_set.spectrum_size, train_set.size);
+		auto& data = train_set.data;
+		const auto size = train_set.size;
+		parse_values<double>(ptr, data_file.end(), data.size(), [&data, size](std::size_t index, double value)
+		{
+			data(index / size, index % size) = value;
+		});
+	}
+
+	read_labels(labels_file_name, train_set);
+	return train_set;
+}
+
+// Reads a training set applying the pre-processing stage on the fly
+Spectral_train_set read_train_set(const std::string& data_file_name, const std::string& labels_file_name,
+	const Spectral_preprocessor& preprocessor)
+{
 	Spectral_train_set train_set;
-	data_file >> train_set.spectrum_size >> train_set.size;
 
-	train_set.data.resize(train_set.spectrum_size, train_set.size);
-	for (std::size_t s = 0; s < train_set.spectrum_size; ++s)
-		for (std::size_t i = 0; i < train_set.size; ++i)
-			data_file >> train_set.data(s, i);
+	{
+		const Mapped_file data_file(data_file_name);
+		auto ptr = parse_value(data_file.begin(), data_file.end(), train_set.spectrum_size);
+		ptr = parse_value(ptr, data_file.end(), train_set.size);
 
-	std::ifstream labels_file;
-	labels_file.exceptions(std::ifstream::badbit | std::ifstream::failbit);
-	labels_file.open(labels_file_name);
+		const auto input_size = train_set.spectrum_size;
+		if (input_size != preprocessor.input_size())
+			throw std::runtime_error("Inconsistent spectrum size in " + data_file_name);
 
-	std::size_t labels_size;
-	labels_file >> train_set.n_label_values >> labels_size;
-	assert(labels_size == train_set.size);
+		const auto size = train_set.size;
+		train_set.spectrum_size = preprocessor.output_size();
+		train_set.data.resize(train_set.spectrum_size, size);
 
-	train_set.labels.resize(labels_size);
-	for (std::size_t i = 0; i < labels_size; ++i)
-		labels_file >> train_set.labels[i];
+		const auto data = train_set.data.data();
+		const auto output_size = train_set.spectrum_size;
+		for (std::size_t j = 0; j < size; ++j)
+			preprocessor.init_spectrum(data + j * output_size);
+
+		// Values are stored band by band, so a thread processes a group of
+		// whole input bands that contribute into a separate set of output bands
+		parse_values<double>(ptr, data_file.end(), input_size * size,
+			[&preprocessor, size](std::size_t index)
+			{ return index % size == 0 && preprocessor.can_split_before(index / size); },
+			[&preprocessor, data, size, output_size](std::size_t index, double value)
+			{
+				preprocessor.add_value(index / size, value, data + (index % size) * output_size);
+			});
+	}
 
+	read_labels(labels_file_name, train_set);
 	return train_set;
 }
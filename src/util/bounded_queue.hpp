@@ -0,0 +1,69 @@
+#pragma once
+#include <cassert>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <utility>
+
+// Multi-producer multi-consumer FIFO queue of a bounded capacity;
+// push() blocks while the queue is full, pop() blocks while it is empty
+template<typename T>
+class Bounded_queue
+{
+public:
+	explicit Bounded_queue(std::size_t capacity) : capacity_(capacity)
+	{
+		assert(capacity > 0);
+	}
+
+	// Returns false if the queue has been closed
+	bool push(T value)
+	{
+		std::unique_lock lock(mutex_);
+		not_full_.wait(lock, [this] { return closed_ || queue_.size() < capacity_; });
+		if (closed_)
+			return false;
+
+		queue_.push_back(std::move(value));
+		lock.unlock();
+		not_empty_.notify_one();
+		return true;
+	}
+
+	// Returns false if the queue has been closed and is empty
+	bool pop(T& value)
+	{
+		std::unique_lock lock(mutex_);
+		not_empty_.wait(lock, [this] { return closed_ || !queue_.empty(); });
+		if (queue_.empty())
+			return false;
+
+		value = std::move(queue_.front());
+		queue_.pop_front();
+		lock.unlock();
+		not_full_.notify_one();
+		return true;
+	}
+
+	// Wakes up all waiting threads; values that are
+	// already in the queue can still be popped
+	void close()
+	{
+		{
+			std::lock_guard lock(mutex_);
+			closed_ = true;
+		}
+		not_full_.notify_all();
+		not_empty_.notify_all();
+	}
+
+private:
+	const std::size_t capacity_;
+	std::deque<T> queue_;
+	bool closed_ = false;
+
+	std::mutex mutex_;
+	std::condition_variable not_full_;
+	std::condition_variable not_empty_;
+};
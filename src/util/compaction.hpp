@@ -0,0 +1,44 @@
+#pragma once
+#include <esl/dense.hpp>
+#include <esu/type_traits.hpp>
+
+#include <cassert>
+#include <cstddef>
+#include <vector>
+
+// Returns indices of non-zero mask elements
+template<class Mask>
+std::vector<std::size_t> valid_indices(const Mask& mask)
+{
+	std::vector<std::size_t> indices;
+	for (std::size_t i = 0; i < mask.size(); ++i)
+		if (mask[i])
+			indices.push_back(i);
+	return indices;
+}
+
+// Gathers the given columns into a dense matrix
+template<class In>
+esl::Matrix_xd gather_cols(const In& in, const std::size_t* indices, std::size_t n)
+{
+	esl::Matrix_xd out(in.rows(), n);
+	for (std::size_t j = 0; j < n; ++j)
+		out.col_view(j) = in.col_view(indices[j]);
+	return out;
+}
+
+template<class In>
+esl::Matrix_xd gather_cols(const In& in, const std::vector<std::size_t>& indices)
+{
+	return gather_cols(in, indices.data(), indices.size());
+}
+
+// The input can be a vector or a view
+template<class Vector>
+auto gather_rows(const Vector& in, const std::vector<std::size_t>& indices)
+{
+	esl::Vector_x<esu::Remove_cv_ref<decltype(in[0])>> out(indices.size());
+	for (std::size_t i = 0; i < indices.size(); ++i)
+		out[i] = in[indices[i]];
+	return out;
+}
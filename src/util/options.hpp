@@ -0,0 +1,136 @@
+#pragma once
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Command-line options of the form "command --key=value --flag ...";
+// "--config=<file>" reads "key = value" lines from the file ('#' starts
+// a comment), command-line options take precedence over the file ones;
+// dashes and underscores in keys are equivalent
+class Options
+{
+public:
+	Options(int argc, const char* const argv[])
+	{
+		for (int i = 1; i < argc; ++i)
+		{
+			const std::string arg = argv[i];
+			if (arg.compare(0, 2, "--") != 0)
+			{
+				if (!command_.empty())
+					throw std::runtime_error("Unexpected argument " + arg);
+				command_ = arg;
+				continue;
+			}
+
+			const auto eq = arg.find('=');
+			if (eq == std::string::npos)
+				values_[normalize(arg.substr(2))] = "1";
+			else
+				values_[normalize(arg.substr(2, eq - 2))] = arg.substr(eq + 1);
+		}
+
+		if (has("config"))
+			read_config(get("config"));
+	}
+
+	const std::string& command() const
+	{
+		return command_;
+	}
+
+	bool has(const std::string& key) const
+	{
+		return values_.count(normalize(key)) > 0;
+	}
+
+	// Returns the value of the required option
+	const std::string& get(const std::string& key) const
+	{
+		const auto it = values_.find(normalize(key));
+		if (it == values_.end())
+			throw std::runtime_error("Missing option --" + key);
+		return it->second;
+	}
+
+	template<typename T>
+	T get(const std::string& key, T default_value) const
+	{
+		const auto it = values_.find(normalize(key));
+		if (it == values_.end())
+			return default_value;
+
+		T value;
+		std::istringstream ss(it->second);
+		if (!(ss >> value) || !(ss >> std::ws).eof())
+			throw std::runtime_error("Bad value of option --" + key + ": " + it->second);
+		return value;
+	}
+
+	std::string get(const std::string& key, const char* default_value) const
+	{
+		return has(key) ? get(key) : default_value;
+	}
+
+	// Throws if an option given on the command line or in the config file
+	// is not one of the accepted keys, so that misspelled options are not ignored;
+	// "config" is always accepted
+	void check_keys(const std::vector<std::string>& accepted_keys) const
+	{
+		for (const auto& [key, value] : values_)
+		{
+			const auto is_accepted = [&key = key](const std::string& accepted) { return normalize(accepted) == key; };
+			if (key != "config" && std::none_of(accepted_keys.begin(), accepted_keys.end(), is_accepted))
+			{
+				auto option = key;
+				std::replace(option.begin(), option.end(), '_', '-');
+				throw std::runtime_error("Unknown option --" + option);
+			}
+		}
+	}
+
+private:
+	void read_config(const std::string& file_name)
+	{
+		std::ifstream file(file_name);
+		if (!file)
+			throw std::runtime_error("Cannot open config file " + file_name);
+
+		std::string line;
+		while (std::getline(file, line))
+		{
+			line.erase(std::find(line.begin(), line.end(), '#'), line.end());
+			if (trim(line).empty())
+				continue;
+
+			const auto eq = line.find('=');
+			if (eq == std::string::npos)
+				throw std::runtime_error("Bad line in config file " + file_name + ": " + line);
+
+			// Existing (command-line) values are not overwritten
+			values_.emplace(normalize(trim(line.substr(0, eq))), trim(line.substr(eq + 1)));
+		}
+	}
+
+	static std::string trim(const std::string& str)
+	{
+		const auto first = str.find_first_not_of(" \t\r");
+		if (first == std::string::npos)
+			return {};
+		return str.substr(first, str.find_last_not_of(" \t\r") - first + 1);
+	}
+
+	static std::string normalize(std::string key)
+	{
+		std::replace(key.begin(), key.end(), '-', '_');
+		return key;
+	}
+
+private:
+	std::string command_;
+	std::map<std::string, std::string> values_;
+};
@@ -0,0 +1,231 @@
+#pragma once
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Stream socket; endpoints are given as "unix:<path>" or "tcp:<host>:<port>"
+class Socket
+{
+public:
+	Socket() = default;
+
+	explicit Socket(int fd) : fd_(fd)
+	{}
+
+	Socket(Socket&& other) noexcept : fd_(std::exchange(other.fd_, -1))
+	{}
+
+	Socket& operator=(Socket&& other) noexcept
+	{
+		std::swap(fd_, other.fd_);
+		return *this;
+	}
+
+	~Socket()
+	{
+		if (fd_ >= 0)
+			::close(fd_);
+	}
+
+	int fd() const
+	{
+		return fd_;
+	}
+
+	static Socket listen(const std::string& endpoint)
+	{
+		Socket socket;
+		if (is_unix(endpoint))
+		{
+			const auto addr = unix_address(endpoint);
+			::unlink(addr.sun_path);
+
+			socket = Socket(::socket(AF_UNIX, SOCK_STREAM, 0));
+			socket.check(socket.fd_ >= 0, "create socket");
+			socket.check(::bind(socket.fd_, reinterpret_cast<const ::sockaddr*>(&addr), sizeof(addr)) == 0,
+				"bind to " + endpoint);
+		}
+		else
+		{
+			const auto info = tcp_address(endpoint, true);
+			socket = Socket(::socket(info->ai_family, info->ai_socktype, info->ai_protocol));
+			socket.check(socket.fd_ >= 0, "create socket");
+
+			const int one = 1;
+			::setsockopt(socket.fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+			const bool bound = (::bind(socket.fd_, info->ai_addr, info->ai_addrlen) == 0);
+			::freeaddrinfo(info);
+			socket.check(bound, "bind to " + endpoint);
+		}
+
+		socket.check(::listen(socket.fd_, 16) == 0, "listen on " + endpoint);
+		return socket;
+	}
+
+	// Connects to the endpoint retrying until the peer starts listening
+	static Socket connect(const std::string& endpoint, std::chrono::seconds timeout)
+	{
+		const auto deadline = std::chrono::steady_clock::now() + timeout;
+		while (true)
+		{
+			Socket socket;
+			bool connected;
+			if (is_unix(endpoint))
+			{
+				const auto addr = unix_address(endpoint);
+				socket = Socket(::socket(AF_UNIX, SOCK_STREAM, 0));
+				socket.check(socket.fd_ >= 0, "create socket");
+				connected = (::connect(socket.fd_, reinterpret_cast<const ::sockaddr*>(&addr), sizeof(addr)) == 0);
+			}
+			else
+			{
+				const auto info = tcp_address(endpoint, false);
+				socket = Socket(::socket(info->ai_family, info->ai_socktype, info->ai_protocol));
+				socket.check(socket.fd_ >= 0, "create socket");
+				connected = (::connect(socket.fd_, info->ai_addr, info->ai_addrlen) == 0);
+				::freeaddrinfo(info);
+			}
+
+			if (connected)
+			{
+				socket.set_options();
+				return socket;
+			}
+
+			if (std::chrono::steady_clock::now() > deadline)
+				throw std::runtime_error("Cannot connect to " + endpoint);
+			std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		}
+	}
+
+	Socket accept() const
+	{
+		Socket socket(::accept(fd_, nullptr, nullptr));
+		check(socket.fd_ >= 0, "accept connection");
+		socket.set_options();
+		return socket;
+	}
+
+	// Simultaneously sends send_size bytes into the socket out and receives
+	// recv_size bytes from the socket in, so that peers in a ring do not block
+	// each other when socket buffers are full
+	static void exchange(
+		const Socket& out, const void* send_data, std::size_t send_size, const Socket& in, void* recv_data,
+		std::size_t recv_size)
+	{
+		auto send_ptr = static_cast<const char*>(send_data);
+		auto recv_ptr = static_cast<char*>(recv_data);
+
+		while (send_size > 0 || recv_size > 0)
+		{
+			::pollfd fds[2] = {{out.fd_, 0, 0}, {in.fd_, 0, 0}};
+			if (send_size > 0)
+				fds[0].events = POLLOUT;
+			if (recv_size > 0)
+				fds[1].events = POLLIN;
+
+			if (::poll(fds, 2, -1) < 0)
+				throw std::runtime_error("Socket poll failed");
+
+			if (send_size > 0 && (fds[0].revents & (POLLOUT | POLLERR | POLLHUP)))
+			{
+				const auto n = ::send(out.fd_, send_ptr, send_size, MSG_NOSIGNAL);
+				if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+					throw std::runtime_error("Socket send failed");
+				if (n > 0)
+				{
+					send_ptr += n;
+					send_size -= static_cast<std::size_t>(n);
+				}
+			}
+
+			if (recv_size > 0 && (fds[1].revents & (POLLIN | POLLERR | POLLHUP)))
+			{
+				const auto n = ::recv(in.fd_, recv_ptr, recv_size, 0);
+				if (n == 0)
+					throw std::runtime_error("Connection closed by peer");
+				if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+					throw std::runtime_error("Socket receive failed");
+				if (n > 0)
+				{
+					recv_ptr += n;
+					recv_size -= static_cast<std::size_t>(n);
+				}
+			}
+		}
+	}
+
+private:
+	void check(bool ok, const std::string& what) const
+	{
+		if (!ok)
+			throw std::runtime_error("Cannot " + what + ": " + std::strerror(errno));
+	}
+
+	void set_options()
+	{
+		::fcntl(fd_, F_SETFL, ::fcntl(fd_, F_GETFL) | O_NONBLOCK);
+
+		int one = 1;
+		::setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
+
+	static bool is_unix(const std::string& endpoint)
+	{
+		if (endpoint.compare(0, 5, "unix:") == 0)
+			return true;
+		if (endpoint.compare(0, 4, "tcp:") == 0)
+			return false;
+		throw std::runtime_error("Bad endpoint " + endpoint);
+	}
+
+	static ::sockaddr_un unix_address(const std::string& endpoint)
+	{
+		const auto path = endpoint.substr(5);
+
+		::sockaddr_un addr{};
+		addr.sun_family = AF_UNIX;
+		if (path.size() >= sizeof(addr.sun_path))
+			throw std::runtime_error("Too long socket path " + path);
+		std::strcpy(addr.sun_path, path.c_str());
+		return addr;
+	}
+
+	static ::addrinfo* tcp_address(const std::string& endpoint, bool passive)
+	{
+		const auto colon = endpoint.rfind(':');
+		if (colon <= 4)
+			throw std::runtime_error("Bad endpoint " + endpoint);
+
+		const auto host = endpoint.substr(4, colon - 4);
+		const auto port = endpoint.substr(colon + 1);
+
+		::addrinfo hints{};
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = passive ? AI_PASSIVE : 0;
+
+		::addrinfo* info;
+		if (::getaddrinfo(host.c_str(), port.c_str(), &hints, &info) != 0)
+			throw std::runtime_error("Cannot resolve " + endpoint);
+		return info;
+	}
+
+private:
+	int fd_ = -1;
+};
@@ -0,0 +1,214 @@
+#pragma once
+#include <algorithm>
+#include <charconv>
+#include <cstddef>
+#include <exception>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Read-only memory mapping of a whole file
+class Mapped_file
+{
+public:
+	explicit Mapped_file(const std::string& file_name)
+	{
+		const int fd = ::open(file_name.c_str(), O_RDONLY);
+		if (fd < 0)
+			throw std::runtime_error("Cannot open file " + file_name);
+
+		struct ::stat st;
+		if (::fstat(fd, &st) != 0)
+		{
+			::close(fd);
+			throw std::runtime_error("Cannot stat file " + file_name);
+		}
+
+		size_ = static_cast<std::size_t>(st.st_size);
+		if (size_ > 0)
+		{
+			data_ = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (data_ == MAP_FAILED)
+			{
+				::close(fd);
+				throw std::runtime_error("Cannot map file " + file_name);
+			}
+			::madvise(data_, size_, MADV_SEQUENTIAL);
+		}
+
+		::close(fd);
+	}
+
+	Mapped_file(const Mapped_file&) = delete;
+	Mapped_file& operator=(const Mapped_file&) = delete;
+
+	~Mapped_file()
+	{
+		if (size_ > 0)
+			::munmap(data_, size_);
+	}
+
+	const char* begin() const
+	{
+		return static_cast<const char*>(data_);
+	}
+
+	const char* end() const
+	{
+		return begin() + size_;
+	}
+
+	std::size_t size() const
+	{
+		return size_;
+	}
+
+private:
+	void* data_ = nullptr;
+	std::size_t size_ = 0;
+};
+
+namespace internal
+{
+inline bool is_space(char ch)
+{
+	return ch == ' ' || ch == '\n' || ch == '\r' || ch == '\t';
+}
+
+inline const char* skip_spaces(const char* first, const char* last)
+{
+	while (first != last && is_space(*first))
+		++first;
+	return first;
+}
+
+inline const char* skip_token(const char* first, const char* last)
+{
+	while (first != last && !is_space(*first))
+		++first;
+	return first;
+}
+
+inline std::size_t count_tokens(const char* first, const char* last)
+{
+	std::size_t n = 0;
+	for (first = skip_spaces(first, last); first != last; first = skip_spaces(first, last))
+	{
+		first = skip_token(first, last);
+		++n;
+	}
+	return n;
+}
+} // namespace internal
+
+// Parses a single whitespace-separated value and returns the pointer past it
+template<typename T>
+const char* parse_value(const char* first, const char* last, T& value)
+{
+	first = internal::skip_spaces(first, last);
+	const auto [ptr, ec] = std::from_chars(first, last, value);
+	if (ec != std::errc{} || (ptr != last && !internal::is_space(*ptr)))
+		throw std::runtime_error("Bad value in text file: " + std::string(first, internal::skip_token(first, last)));
+	return ptr;
+}
+
+// Parses exactly n_values whitespace-separated values from [first, last)
+// in parallel; store(index, value) is called for each value, from several
+// threads, but never twice with the same index; a chunk processed
+// by a thread can start only at the value index for which can_split(index)
+// is true, so store() calls for indices between such points are sequential
+template<typename T, class Split_fn, class Store_fn>
+void parse_values(const char* first, const char* last, std::size_t n_values, Split_fn can_split, Store_fn store)
+{
+	// Small chunks are not worth a thread
+	constexpr std::size_t min_chunk_size = 1 << 20;
+
+	const auto size = static_cast<std::size_t>(last - first);
+	const auto n_chunks = std::max<std::size_t>(
+		1, std::min<std::size_t>(std::thread::hardware_concurrency(), size / min_chunk_size));
+
+	// Chunk boundaries are moved forward to the nearest whitespace
+	std::vector<const char*> bounds(n_chunks + 1, last);
+	bounds[0] = first;
+	for (std::size_t i = 1; i < n_chunks; ++i)
+		bounds[i] = internal::skip_token(std::max(bounds[i - 1], first + i * (size / n_chunks)), last);
+
+	// Exceptions are caught in each chunk, all threads are joined,
+	// and the exception of the first failed chunk is rethrown
+	const auto run_parallel = [n_chunks](auto fn)
+	{
+		std::vector<std::exception_ptr> errors(n_chunks);
+		const auto run = [&fn, &errors](std::size_t i)
+		{
+			try
+			{
+				fn(i);
+			}
+			catch (...)
+			{
+				errors[i] = std::current_exception();
+			}
+		};
+
+		std::vector<std::thread> workers;
+		for (std::size_t i = 1; i < n_chunks; ++i)
+			workers.emplace_back(run, i);
+		run(0);
+		for (auto& w : workers)
+			w.join();
+
+		for (const auto& error : errors)
+			if (error)
+				std::rethrow_exception(error);
+	};
+
+	// The first pass counts values in each chunk to find the index of its first value
+	std::vector<std::size_t> first_index(n_chunks + 1, 0);
+	run_parallel([&](std::size_t i) { first_index[i + 1] = internal::count_tokens(bounds[i], bounds[i + 1]); });
+	for (std::size_t i = 0; i < n_chunks; ++i)
+		first_index[i + 1] += first_index[i];
+
+	if (first_index.back() != n_values)
+		throw std::runtime_error("Expected " + std::to_string(n_values) + " values in text file, found " +
+								 std::to_string(first_index.back()));
+
+	// Chunk boundaries are then moved forward to the nearest split points
+	for (std::size_t i = 1; i < n_chunks; ++i)
+	{
+		if (first_index[i] < first_index[i - 1])
+		{
+			bounds[i] = bounds[i - 1];
+			first_index[i] = first_index[i - 1];
+		}
+
+		while (first_index[i] < n_values && !can_split(first_index[i]))
+		{
+			bounds[i] = internal::skip_token(internal::skip_spaces(bounds[i], last), last);
+			++first_index[i];
+		}
+	}
+
+	run_parallel([&](std::size_t i)
+	{
+		auto ptr = bounds[i];
+		for (auto index = first_index[i]; index < first_index[i + 1]; ++index)
+		{
+			T value;
+			ptr = parse_value(ptr, last, value);
+			store(index, value);
+		}
+	});
+}
+
+template<typename T, class Store_fn>
+void parse_values(const char* first, const char* last, std::size_t n_values, Store_fn store)
+{
+	parse_values<T>(first, last, n_values, [](std::size_t) { return true; }, store);
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include <cstddef>
+#include <thread>
+
+#include <pthread.h>
+#include <sched.h>
+
+// Pins the calling thread to the index-th (modulo their number) of CPUs
+// the process is allowed to run on, returns false on failure
+inline bool pin_current_thread(std::size_t index)
+{
+	::cpu_set_t allowed;
+	if (::sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+		return false;
+
+	const auto n_cpus = static_cast<std::size_t>(CPU_COUNT(&allowed));
+	if (n_cpus == 0)
+		return false;
+
+	index %= n_cpus;
+	for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+		if (CPU_ISSET(cpu, &allowed) && index-- == 0)
+		{
+			::cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(cpu, &set);
+			return ::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set) == 0;
+		}
+
+	return false;
+}
+
+// Returns true if threads can be pinned to CPUs,
+// the check is done in a temporary thread
+inline bool can_pin_threads()
+{
+	bool pinned = false;
+	std::thread([&pinned] { pinned = pin_current_thread(0); }).join();
+	return pinned;
+}